@@ -2,8 +2,32 @@
 
 #include <cstring>
 #include <cstdio>
+#include <cstdint>
+#include <cmath>
 #include <iostream>
-#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cerrno>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <set>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
 
 using std::cout;
 using std::endl;
@@ -12,9 +36,48 @@ using std::string;
 
 void help() {
     cout << "LZSS Compressor/Decompressor" << endl << endl;
-    cout << "lzss [-c|-d] input_file output_file" << endl << endl;
-    cout << "  -c   compress input_file to output_file" << endl;
-    cout << "  -d   decompress input_file to output_file" << endl << endl;
+    cout << "lzss [-c|-d] input_file output_file [options]" << endl;
+    cout << "lzss -a trace_file" << endl;
+    cout << "lzss -b input_file" << endl;
+    cout << "lzss merge output_file segment_file..." << endl;
+    cout << "lzss append log_file [--level n] [--restart kb]" << endl;
+    cout << "lzss tail log_file [--follow]" << endl;
+    cout << "lzss grep input_file pattern... [--threads n] [--count]" << endl;
+    cout << "lzss archive archive_file path... [--level n]" << endl;
+    cout << "lzss extract archive_file [member...]" << endl;
+    cout << "lzss list archive_file" << endl << endl;
+    cout << "  -c                 compress input_file to output_file" << endl;
+    cout << "  -d                 decompress input_file to output_file" << endl;
+    cout << "  -a                 summarise the parse decisions recorded in trace_file" << endl;
+    cout << "  -b                 benchmark the codec on a sample of input_file" << endl;
+    cout << "  merge              join segments compressed with --range into one file" << endl;
+    cout << "  append             append each line of standard input to log_file as a record, with a" << endl;
+    cout << "                     restart point every kb KB (default 64)" << endl;
+    cout << "  tail               write the records of log_file from its last restart point" << endl;
+    cout << "  grep               report the offset of each pattern in the decompressed input_file, or" << endl;
+    cout << "                     with --count the number of matches; -e marks a pattern starting with -" << endl;
+    cout << "  archive            store the files and directories given in archive_file, in blocks that" << endl;
+    cout << "                     span many files" << endl;
+    cout << "  extract            write the members of archive_file below the current directory, or only" << endl;
+    cout << "                     the members named, decoding just the blocks that hold them" << endl;
+    cout << "  list               list the length and name of each member of archive_file" << endl << endl;
+    cout << "Options:" << endl << endl;
+    cout << "  --stats            report read, compress/decompress and write times, throughput," << endl;
+    cout << "                     ratio, peak memory and thread utilisation" << endl;
+    cout << "  --level n          compression level from 0 (fastest) to 9 (exhaustive search, default), or" << endl;
+    cout << "                     10 to choose matches for the smallest output" << endl;
+    cout << "  --prefetch n       positions ahead at which the hash chains are prefetched (default 0, off)" << endl;
+    cout << "  --trace file       record every parse decision made while compressing" << endl;
+    cout << "  --range off:len    compress len bytes of input_file from off as a segment for merging" << endl;
+    cout << "  --threads n        number of threads used to find matches or decompress blocks (default 1)" << endl;
+    cout << "  --legacy           compress to a single stream without frame or blocks" << endl;
+    cout << "  --readahead n      decompress up to n blocks ahead of writing on a background thread" << endl;
+    cout << "  --lanes n          split each block into n streams that decompress side by side (1 to 4)" << endl;
+    cout << "  --no-detect        compress every block the same way rather than choosing a filter," << endl;
+    cout << "                     dictionary or raw storage from its content" << endl;
+    cout << "  --resume           record progress in output_file.ckpt and continue from it if an earlier" << endl;
+    cout << "                     run with the same settings was interrupted" << endl;
+    cout << "  --direct           write output_file with O_DIRECT, bypassing the page cache" << endl << endl;
 }
 
 
@@ -24,267 +87,5984 @@ void error(const std::string &error) {
 }
 
 
-int compress(const void* input, int inputLength, void* output, int outputLength, int dictionaryLength)
+int findMatch(const unsigned char* start, const unsigned char* current, const unsigned char* end,
+			  int maxOffset, int maxMatch, int& bestOffset, int& candidates)
+{
+	// Find the start of the search window
+	const unsigned char* search = current - maxOffset;
+	if (search < start) search = start;
+
+	// Find the longest match in the search window. A match may not overlap the current position and
+	// the nearest of several equally long matches is preferred.
+	int bestLength = 0;
+	while ((search + bestLength) <= current)
+	{
+		const unsigned char* p1 = search;
+		const unsigned char* p2 = current;
+		int matchLength = 0;
+
+		while ((p2 < end) && (p1 < current) && (matchLength < maxMatch) && (*p1 == *p2))
+		{
+			p1++;
+			p2++;
+			matchLength++;
+		}
+
+		if (matchLength >= bestLength)
+		{
+			bestLength = matchLength;
+			bestOffset = (int)(current - search);
+		}
+
+		candidates++;
+		search++;
+	}
+
+	return bestLength;
+}
+
+
+void traceToken(FILE* trace, const unsigned char* start, const unsigned char* current, const unsigned char* end,
+				int maxOffset, int maxMatch, int bestLength, int bestOffset, int candidates)
+{
+	// Each line of the trace records one parse decision:
+	//   <position> L <byte> <best length> <candidates> <best length in the largest window>
+	//   <position> M <offset> <length> <candidates> <unlimited length> <best length at next position>
+	// The extra columns are what the analyser needs to measure waste; the largest window is the one
+	// used by a 4 byte dictionary (16386 bytes) and the unlimited length ignores maxMatch.
+	long long position = current - start;
+	int unused = 0;
+	int ignored = 0;
+	if (bestLength > 2)
+	{
+		const unsigned char* p1 = current - bestOffset;
+		const unsigned char* p2 = current;
+		int unlimited = 0;
+		while ((p1 < current) && (p2 < end) && (*p1 == *p2))
+		{
+			p1++;
+			p2++;
+			unlimited++;
+		}
+
+		int next = (current + 1 < end) ? findMatch(start, current + 1, end, maxOffset, maxMatch, unused, ignored) : 0;
+		fprintf(trace, "%lld M %d %d %d %d %d\n", position, bestOffset, bestLength, candidates, unlimited, next);
+	}
+	else
+	{
+		int far = findMatch(start, current, end, 16386, maxMatch, unused, ignored);
+		fprintf(trace, "%lld L %d %d %d %d\n", position, *current, bestLength, candidates, far);
+	}
+}
+
+
+// Compression levels 1 to 8 find matches with hash chains, searching further back along the chains at
+// each level. Level 9 compares against every position in the window and always finds the longest match.
+// Level 10 finds the longest match at every position with a suffix array and chooses between literals
+// and strings to minimise the total size rather than always taking the longest match. Level 0 looks up a
+// single candidate in each of two small hash tables and is the fastest.
+const int LEVEL_FASTEST = 0;
+const int LEVEL_DOUBLE_FAST = 0;
+const int LEVEL_EXHAUSTIVE = 9;
+const int LEVEL_OPTIMAL = 10;
+
+
+class PreparedDictionary;
+
+
+struct CompressOptions
+{
+	int level = LEVEL_EXHAUSTIVE;
+	int prefetchDistance = 0;		// Positions ahead of the parse at which hash chain entries are prefetched
+	int threads = 1;				// Threads used to find matches ahead of the parse
+	int hashBits = 15;				// The hash chain head table has 2^hashBits entries
+	const PreparedDictionary* dictionary = nullptr;	// Data the input is compressed against, prepared in advance
+	FILE* trace = nullptr;			// Receives a line for every parse decision when set
+};
+
+
+class HashChain
+{
+public:
+	// Every position is indexed by a hash of its first 3 bytes. The head table holds the most recent
+	// position with each hash and the chain links each position to the previous one with the same hash,
+	// so candidates are visited nearest first. The chain is a ring covering the window since positions
+	// further back can't be matched.
+	static const int MAX_PREFETCH_DISTANCE = 32;
+
+	HashChain(const unsigned char* start, const unsigned char* end, int maxOffset, int maxMatch, int maxChain, int prefetchDistance,
+			  int hashBits)
+		: start(start), end(end), maxOffset(maxOffset), maxMatch(maxMatch), maxChain(maxChain),
+		  prefetchDistance(prefetchDistance < MAX_PREFETCH_DISTANCE ? prefetchDistance : MAX_PREFETCH_DISTANCE),
+		  hashShift(32 - hashBits)
+	{
+		int chainLength = 1;
+		while (chainLength <= maxOffset) chainLength <<= 1;
+		chainMask = chainLength - 1;
+		head.assign((size_t)1 << (32 - hashShift), -maxOffset - 1);
+		chain.resize((size_t)chainLength);
+		prime(start);
+	}
+
+	// Prepare to index positions from current onwards. Hashes are calculated once, prefetchDistance
+	// positions ahead of the parse, and kept in a ring.
+	void prime(const unsigned char* current)
+	{
+		int position = (int)(current - start);
+		for (int ahead = position; ahead <= position + prefetchDistance; ahead++)
+		{
+			hashes[ahead & (RING_LENGTH - 1)] = hash(start + ahead);
+		}
+	}
+
+	// Find the longest match for the string at current, returning its length and storing its offset
+	int find(const unsigned char* current, int& bestOffset, int& candidates)
+	{
+		int position = (int)(current - start);
+		if (current + 3 > end) return 0;
+
+		int bestLength = 0;
+		int limit = position - maxOffset;
+		unsigned int h = hashes[position & (RING_LENGTH - 1)];
+		int candidate = head[h];
+		const HashChain* chains = this;
+		for (int depth = maxChain; depth; depth--)
+		{
+			// The chain continues into the dictionary's chains below the positions indexed here
+			if ((candidate < ownBegin) && dictionary && (chains == this))
+			{
+				chains = dictionary;
+				candidate = dictionary->head[h];
+			}
+			if (candidate < limit) break;
+
+			// A match can't overlap the current position so it is limited by its offset
+			int offset = position - candidate;
+			int maxLength = (offset < maxMatch) ? offset : maxMatch;
+			if (maxLength > end - current) maxLength = (int)(end - current);
+			if (maxLength > bestLength)
+			{
+				const unsigned char* p1 = start + candidate;
+				int length = 0;
+				while ((length < maxLength) && (p1[length] == current[length])) length++;
+				if (length > bestLength)
+				{
+					bestLength = length;
+					bestOffset = offset;
+					if (length == maxLength && maxLength == maxMatch) break;
+				}
+			}
+			candidates++;
+			candidate = chains->chain[candidate & chains->chainMask];
+		}
+		return bestLength;
+	}
+
+	// Continue chains that reach below the positions indexed here into those of a dictionary, which
+	// indexed the data before them, returning the number of positions the dictionary indexed. The data
+	// must be the dictionary's followed by the data to compress, and the dictionary is only read.
+	int attach(const HashChain& dictionary)
+	{
+		this->dictionary = &dictionary;
+		ownBegin = dictionary.indexed();
+		return ownBegin;
+	}
+
+	// Return the number of positions from the start that have been indexed
+	int indexed() const
+	{
+		return (end - start > 2) ? (int)(end - start) - 2 : 0;
+	}
+
+	// Add count positions starting at current to the chains
+	void insert(const unsigned char* current, int count)
+	{
+		int position = (int)(current - start);
+		for (int i = 0; i < count; i++, position++)
+		{
+			// Hash the position prefetchDistance ahead and prefetch its head entry, then for the position
+			// half as far ahead, whose head entry should now be cached, prefetch the chain entry and the
+			// data of its nearest candidate. By the time the parse reaches those positions the memory
+			// they need is already on its way.
+			int ahead = position + (prefetchDistance ? prefetchDistance : 1);
+			unsigned int aheadHash = hash(start + ahead);
+			hashes[ahead & (RING_LENGTH - 1)] = aheadHash;
+			if (prefetchDistance)
+			{
+				__builtin_prefetch(&head[aheadHash]);
+			}
+			if (prefetchDistance > 1)
+			{
+				int candidate = head[hashes[(position + prefetchDistance / 2) & (RING_LENGTH - 1)]];
+				if (candidate >= 0)
+				{
+					__builtin_prefetch(&chain[candidate & chainMask]);
+					__builtin_prefetch(start + candidate);
+				}
+			}
+
+			if (start + position + 3 <= end)
+			{
+				unsigned int h = hashes[position & (RING_LENGTH - 1)];
+				chain[position & chainMask] = head[h];
+				head[h] = position;
+			}
+		}
+	}
+
+private:
+	static const int RING_LENGTH = 64;
+
+	unsigned int hash(const unsigned char* p) const
+	{
+		if (p + 3 > end) return 0;
+		unsigned int value = (unsigned int)p[0] | ((unsigned int)p[1] << 8) | ((unsigned int)p[2] << 16);
+		return (value * 2654435761u) >> hashShift;
+	}
+
+	const unsigned char* start;
+	const unsigned char* end;
+	int maxOffset;
+	int maxMatch;
+	int maxChain;
+	int prefetchDistance;
+	int hashShift;
+	int chainMask;
+	std::vector<int> head;
+	std::vector<int> chain;
+	unsigned int hashes[RING_LENGTH];
+	const HashChain* dictionary = nullptr;
+	int ownBegin = 0;				// Positions below this are found through the dictionary's chains
+};
+
+
+class DoubleFast
+{
+public:
+	// Finds matches with two hash tables that each hold the last position seen with a hash, one hashing
+	// 3 bytes to find the short strings that are most of a compressed stream and one hashing 8 bytes,
+	// whose candidates are rarely false and usually run to the longest string allowed. Neither table
+	// has chains, so finding a match costs at most two comparisons.
+	static const int HASH_BITS = 14;
+
+	DoubleFast(const unsigned char* start, const unsigned char* end, int maxOffset, int maxMatch)
+		: start(start), end(end), maxOffset(maxOffset), maxMatch(maxMatch),
+		  shortTable(1 << HASH_BITS, -maxOffset - 1), longTable(1 << HASH_BITS, -maxOffset - 1)
+	{
+	}
+
+	// Find the longer of the matches for the string at current given by the two tables, returning its
+	// length and storing its offset
+	int find(const unsigned char* current, int& bestOffset) const
+	{
+		int position = (int)(current - start);
+		int bestLength = 0;
+		if (current + 8 <= end)
+		{
+			unsigned int h = hashLong(current);
+			int candidate = ((longTable[h] < ownBegin) && dictionary) ? dictionary->longTable[h] : longTable[h];
+			bestLength = length(current, position - candidate, bestOffset);
+		}
+		if ((bestLength < maxMatch) && (current + 3 <= end))
+		{
+			unsigned int h = hashShort(current);
+			int candidate = ((shortTable[h] < ownBegin) && dictionary) ? dictionary->shortTable[h] : shortTable[h];
+			int offset = 0;
+			int shortLength = length(current, position - candidate, offset);
+			if (shortLength > bestLength)
+			{
+				bestLength = shortLength;
+				bestOffset = offset;
+			}
+		}
+		return bestLength;
+	}
+
+	// Look up positions below those indexed here in the tables of a dictionary, returning the number of
+	// positions it indexed. As for HashChain::attach(), the data must follow the dictionary's.
+	int attach(const DoubleFast& dictionary)
+	{
+		this->dictionary = &dictionary;
+		ownBegin = dictionary.indexed();
+		return ownBegin;
+	}
+
+	// Return the number of positions from the start that are in both tables
+	int indexed() const
+	{
+		return (end - start > 7) ? (int)(end - start) - 7 : 0;
+	}
+
+	// Add count positions starting at current to the tables
+	void insert(const unsigned char* current, int count)
+	{
+		for (int i = 0; i < count; i++, current++)
+		{
+			int position = (int)(current - start);
+			if (current + 8 <= end)
+			{
+				longTable[hashLong(current)] = position;
+			}
+			if (current + 3 <= end)
+			{
+				shortTable[hashShort(current)] = position;
+			}
+		}
+	}
+
+private:
+	// Return the length of the match at offset, storing the offset, or 0 if the offset is out of range
+	int length(const unsigned char* current, int offset, int& matchOffset) const
+	{
+		if ((offset < 3) || (offset > maxOffset)) return 0;
+		int maxLength = (offset < maxMatch) ? offset : maxMatch;
+		if (maxLength > end - current) maxLength = (int)(end - current);
+		const unsigned char* p = current - offset;
+		int length = 0;
+		while ((length < maxLength) && (p[length] == current[length])) length++;
+		matchOffset = offset;
+		return length;
+	}
+
+	static unsigned int hashShort(const unsigned char* p)
+	{
+		unsigned int value = (unsigned int)p[0] | ((unsigned int)p[1] << 8) | ((unsigned int)p[2] << 16);
+		return (value * 2654435761u) >> (32 - HASH_BITS);
+	}
+
+	static unsigned int hashLong(const unsigned char* p)
+	{
+		uint64_t value;
+		memcpy(&value, p, sizeof(value));
+		return (unsigned int)((value * 0xcf1bbcdcb7a56463ull) >> (64 - HASH_BITS));
+	}
+
+	const unsigned char* start;
+	const unsigned char* end;
+	int maxOffset;
+	int maxMatch;
+	std::vector<int> shortTable;
+	std::vector<int> longTable;
+	const DoubleFast* dictionary = nullptr;
+	int ownBegin = 0;				// Positions below this are looked up in the dictionary's tables
+};
+
+
+void validateOptions(int dictionaryLength, const CompressOptions& options)
 {
 	// Ensure the dictionary length is legal
 	if ((dictionaryLength & (dictionaryLength - 1)) != 0)
 	{
-		error ("Dictionary length must be a power of 2");
+		error ("Dictionary length must be a power of 2");
+	}
+	if (dictionaryLength < 4)
+	{
+		error ("Dictionary length can not be less than 4 bytes");
+	}
+	if (dictionaryLength > 16384)
+	{
+		error ("Dictionary length can exceed 16384 bytes");
+	}
+	if ((options.level < LEVEL_FASTEST) || (options.level > LEVEL_OPTIMAL))
+	{
+		error ("Compression level must be between 0 and 10");
+	}
+	if (options.prefetchDistance < 0)
+	{
+		error ("Prefetch distance can not be negative");
+	}
+	if (options.threads < 1)
+	{
+		error ("The number of threads must be at least 1");
+	}
+	if ((options.hashBits < 8) || (options.hashBits > 24))
+	{
+		error ("Hash bits must be between 8 and 24");
+	}
+}
+
+
+class PreparedDictionary
+{
+public:
+	// Holds the data that messages are compressed against along with its match finder tables, built
+	// once so that each message only indexes its own data. Only the last maxOffset bytes of data can be
+	// matched, so only those are kept. Once built it is only read, so it can be shared between threads,
+	// and is used by setting CompressOptions::dictionary; the other options must be those given here.
+	PreparedDictionary(const void* data, int length, int dictionaryLength, const CompressOptions& options = CompressOptions())
+		: dictLength(dictionaryLength), compressOptions(options)
+	{
+		validateOptions(dictionaryLength, options);
+		int maxOffset = dictionaryLength + 2;
+		int maxMatch = (65536 / dictionaryLength) + 2;
+		auto p = (const unsigned char*)data;
+		bytes.assign(p + (length > maxOffset ? length - maxOffset : 0), p + length);
+
+		const unsigned char* start = bytes.data();
+		const unsigned char* end = start + bytes.size();
+		if (options.level == LEVEL_DOUBLE_FAST)
+		{
+			fastTables.reset(new DoubleFast(start, end, maxOffset, maxMatch));
+			fastTables->insert(start, (int)bytes.size());
+		}
+		else if (options.level < LEVEL_EXHAUSTIVE)
+		{
+			hashChains.reset(new HashChain(start, end, maxOffset, maxMatch, 2 << options.level, 0, options.hashBits));
+			hashChains->insert(start, (int)bytes.size());
+		}
+		compressOptions.dictionary = nullptr;
+	}
+
+	const std::vector<unsigned char>& data() const
+	{
+		return bytes;
+	}
+
+	int dictionaryLength() const
+	{
+		return dictLength;
+	}
+
+	const CompressOptions& options() const
+	{
+		return compressOptions;
+	}
+
+	// The tables for the level given, or null if it doesn't use them
+	const HashChain* chains() const
+	{
+		return hashChains.get();
+	}
+
+	const DoubleFast* tables() const
+	{
+		return fastTables.get();
+	}
+
+private:
+	std::vector<unsigned char> bytes;
+	int dictLength;
+	CompressOptions compressOptions;
+	std::unique_ptr<HashChain> hashChains;
+	std::unique_ptr<DoubleFast> fastTables;
+};
+
+
+// The compressed data consists of 3 separate streams of data; bit flags, strings, and bytes.
+// The bit flag indicates whether the next element of data is a string or a byte. The string is
+// a 16-bit value containing an offset and a length from which a string should be copied. The byte
+// value is simply a literal that should be stored. The data for each stream is written 32-bits at
+// a time, therefore we accumulate 32 bit flags, 2 strings (16-bits each), or 4 bytes (8-bits each)
+// before storing them. The data for each stream is written as soon as it is accumulated, hence the
+// streams are interleaved in memory. On decompression, the compressed data can be read linearly
+// with the data for each stream arriving exactly as its needed.
+class Encoder
+{
+public:
+	Encoder(int* output, int* outputEnd, int lengthShift) : next(output), outputEnd(outputEnd), lengthShift(lengthShift)
+	{
+	}
+
+	// Write a byte literal, returning false if the output buffer is too small
+	bool literal(unsigned char value)
+	{
+		// Fail before writing anything if there is no room for the words the literal starts
+		if (outputEnd - next < (bitMask == 0) + (byteCount == 0)) return false;
+
+		// If the bit accumulator is empty then reserve memory for the next 32-bits
+		if (bitMask == 0)
+		{
+			nextBits = next++;
+			bits = 0;
+			bitMask = 1;
+		}
+
+		// Write a 0 bit to the bitstream to indicate next item is a byte literal
+		// If we have accumulated 32-bits then flush the bit flags to memory
+		bitMask <<= 1;					// By shifting the bitMask we are implicitly writing a 0 to the bit flags
+		if (!bitMask) *nextBits = bits;
+
+		// If the byte accumulator is empty then reserve memory for the next 4 bytes
+		if (byteCount == 0)
+		{
+			nextBytes = next++;
+			bytes = 0;
+		}
+
+		// Add the current byte value to the byte accumulator
+		bytes += value << (byteCount * 8);
+		byteCount++;
+
+		// If we have accumulated 4 bytes then flush them to memory
+		if (byteCount == 4)
+		{
+			*nextBytes = bytes;
+			byteCount = 0;
+		}
+		encoded++;
+		return true;
+	}
+
+	// Write a string, returning false if the output buffer is too small
+	bool string(int length, int offset)
+	{
+		// Fail before writing anything if there is no room for the words the string starts
+		if (outputEnd - next < (bitMask == 0) + (stringCount == 0)) return false;
+
+		// If the bit accumulator is empty then reserve memory for the next 32-bits
+		if (bitMask == 0)
+		{
+			nextBits = next++;
+			bits = 0;
+			bitMask = 1;
+		}
+
+		// Write a 1 bit to the bit stream to indicate next item is a string
+		// If we have accumulated 32-bits then flush the bit flags to memory
+		bits |= bitMask;
+		bitMask <<= 1;
+		if (!bitMask) *nextBits = bits;
+
+		// If the string accumulator is empty then reserve memory for the next 2 strings
+		if (stringCount == 0)
+		{
+			nextStrings = next++;
+			strings = 0;
+		}
+
+		// Add the string offset and size to the offset accumulator
+		strings += (((length - 3) << lengthShift) + (offset - 3)) << (stringCount * 16);
+		stringCount++;
+
+		// If we have accumulated 2 strings then flush them to memory
+		if (stringCount == 2)
+		{
+			*nextStrings = strings;
+			stringCount = 0;
+		}
+		encoded += length;
+		return true;
+	}
+
+	// Write any remaining data out to their respective streams
+	void finish()
+	{
+		if (bitMask)     *nextBits = bits;
+		if (byteCount)   *nextBytes = bytes;
+		if (stringCount) *nextStrings = strings;
+	}
+
+	// End the data written so far at a point where the decoder can stop without needing any more input.
+	// A string that copies maxMatch bytes from 3 bytes back marks the flush; it can't occur otherwise as
+	// strings never overlap the data they produce. The partly filled words are then written and the next
+	// item starts new ones, so the decoder resets its accumulators when it reads the marker.
+	bool flush(int maxMatch)
+	{
+		if (!string(maxMatch, 3)) return false;
+		encoded -= maxMatch;			// the marker produces no data
+		finish();
+		bitMask = 0;
+		byteCount = 0;
+		stringCount = 0;
+		return true;
+	}
+
+	int* position() const
+	{
+		return next;
+	}
+
+	// Return the number of input bytes encoded by the items written so far. An item that doesn't fit
+	// leaves nothing behind, so those before it form a complete stream of this many bytes once finished.
+	int length() const
+	{
+		return encoded;
+	}
+
+	void setPosition(int* output, int* end)
+	{
+		// Only valid straight after a flush, when no words are waiting to be filled
+		next = output;
+		outputEnd = end;
+	}
+
+private:
+	int* next;
+	int* outputEnd;
+	int  lengthShift;
+	int* nextBits = nullptr;
+	int* nextBytes = nullptr;
+	int* nextStrings = nullptr;
+	int  bits = 0;			// Bit accumulator
+	int  bitMask = 0;
+	int  bytes = 0;			// Byte accumulator
+	int  byteCount = 0;
+	int  strings = 0;		// String accumulator
+	int  stringCount = 0;
+	int  encoded = 0;		// Input bytes encoded
+};
+
+
+void parallelFor(int count, int threads, const std::function<void(int)>& task)
+{
+	// Run task(0) to task(count - 1) on up to threads threads, the calling thread being one of them
+	std::atomic<int> next(0);
+	auto worker = [&]()
+	{
+		for (int index = next++; index < count; index = next++)
+		{
+			task(index);
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (int thread = 1; (thread < threads) && (thread < count); thread++)
+	{
+		workers.emplace_back(worker);
+	}
+	worker();
+	for (auto& thread : workers)
+	{
+		thread.join();
+	}
+}
+
+
+struct Match
+{
+	unsigned short length;
+	unsigned short offset;
+};
+
+
+bool compressRangeParallel(const unsigned char* start, const unsigned char* begin, const unsigned char* end, Encoder& encoder,
+						   int maxOffset, int maxMatch, const CompressOptions& options)
+{
+	// The match found at each position depends only on the data before it, not on the parse, so the
+	// matches for every position can be found in parallel, a chunk per task, before a single pass makes
+	// the same greedy choices as compressRange() and packs them. Finding a match at every position
+	// rather than only where an item starts costs more work in total, which the threads make up for.
+	const int chunkLength = 1 << 18;
+	int length = (int)(end - begin);
+	int chunks = (length + chunkLength - 1) / chunkLength;
+	std::vector<Match> matches((size_t)length);
+	parallelFor(chunks, options.threads, [&](int chunk)
+	{
+		const unsigned char* chunkBegin = begin + (size_t)chunk * chunkLength;
+		const unsigned char* chunkEnd = (end - chunkBegin > chunkLength) ? chunkBegin + chunkLength : end;
+		Match* match = matches.data() + (chunkBegin - begin);
+
+		if (options.level < LEVEL_EXHAUSTIVE)
+		{
+			// The hash chains only need the window before the chunk to give the same candidates as a
+			// single pass, since older positions are never matched
+			const unsigned char* warm = (chunkBegin - start > maxOffset) ? chunkBegin - maxOffset : start;
+			HashChain chains(start, end, maxOffset, maxMatch, 2 << options.level, options.prefetchDistance,
+							 options.hashBits);
+			chains.prime(warm);
+			chains.insert(warm, (int)(chunkBegin - warm));
+			for (auto current = chunkBegin; current < chunkEnd; current++, match++)
+			{
+				int offset = 0;
+				int candidates = 0;
+				match->length = (unsigned short)chains.find(current, offset, candidates);
+				match->offset = (unsigned short)offset;
+				chains.insert(current, 1);
+			}
+		}
+		else
+		{
+			for (auto current = chunkBegin; current < chunkEnd; current++, match++)
+			{
+				int offset = 0;
+				int candidates = 0;
+				match->length = (unsigned short)findMatch(start, current, end, maxOffset, maxMatch, offset, candidates);
+				match->offset = (unsigned short)offset;
+			}
+		}
+	});
+
+	auto current = begin;
+	while (current < end)
+	{
+		const Match& match = matches[(size_t)(current - begin)];
+		if (match.length > 2)
+		{
+			if (!encoder.string(match.length, match.offset)) return false;
+			current += match.length;
+		}
+		else
+		{
+			if (!encoder.literal(*current++)) return false;
+		}
+	}
+	return true;
+}
+
+
+std::vector<int> buildSuffixArray(const std::vector<int>& text, int upper)
+{
+	// Sort the suffixes of text, whose values are between 0 and upper, by induced sorting (SA-IS). Each
+	// suffix is typed S if it sorts before the one that follows it and L otherwise. The leftmost S
+	// suffixes of each run (LMS) are sorted first, by recursing on the string of their substrings if
+	// any are equal, and the order of the other suffixes is then induced from theirs.
+	int n = (int)text.size();
+	if (n == 0) return {};
+	if (n == 1) return { 0 };
+	if (n == 2) return (text[0] < text[1]) ? std::vector<int>{ 0, 1 } : std::vector<int>{ 1, 0 };
+
+	std::vector<int> sa((size_t)n);
+	std::vector<bool> ls((size_t)n);
+	for (int i = n - 2; i >= 0; i--)
+	{
+		ls[(size_t)i] = (text[(size_t)i] == text[(size_t)i + 1]) ? ls[(size_t)i + 1] : (text[(size_t)i] < text[(size_t)i + 1]);
+	}
+
+	// The bucket of each value holds its L suffixes followed by its S suffixes
+	std::vector<int> sumL((size_t)upper + 1);
+	std::vector<int> sumS((size_t)upper + 1);
+	for (int i = 0; i < n; i++)
+	{
+		if (!ls[(size_t)i]) sumS[(size_t)text[(size_t)i]]++;
+		else sumL[(size_t)text[(size_t)i] + 1]++;
+	}
+	for (int i = 0; i <= upper; i++)
+	{
+		sumS[(size_t)i] += sumL[(size_t)i];
+		if (i < upper) sumL[(size_t)i + 1] += sumS[(size_t)i];
+	}
+
+	auto induce = [&](const std::vector<int>& lms)
+	{
+		std::fill(sa.begin(), sa.end(), -1);
+		std::vector<int> bucket(sumS);
+		for (int d : lms)
+		{
+			if (d != n) sa[(size_t)bucket[(size_t)text[(size_t)d]]++] = d;
+		}
+		bucket = sumL;
+		sa[(size_t)bucket[(size_t)text[(size_t)n - 1]]++] = n - 1;
+		for (int i = 0; i < n; i++)
+		{
+			int v = sa[(size_t)i];
+			if ((v >= 1) && !ls[(size_t)v - 1]) sa[(size_t)bucket[(size_t)text[(size_t)v - 1]]++] = v - 1;
+		}
+		bucket = sumL;
+		for (int i = n - 1; i >= 0; i--)
+		{
+			int v = sa[(size_t)i];
+			if ((v >= 1) && ls[(size_t)v - 1]) sa[(size_t)--bucket[(size_t)text[(size_t)v - 1] + 1]] = v - 1;
+		}
+	};
+
+	std::vector<int> lmsMap((size_t)n + 1, -1);
+	std::vector<int> lms;
+	for (int i = 1; i < n; i++)
+	{
+		if (!ls[(size_t)i - 1] && ls[(size_t)i])
+		{
+			lmsMap[(size_t)i] = (int)lms.size();
+			lms.push_back(i);
+		}
+	}
+	int m = (int)lms.size();
+	induce(lms);
+
+	if (m)
+	{
+		// Name the LMS substrings in sorted order, equal substrings sharing a name, and sort the string of
+		// names to get the order of the LMS suffixes
+		std::vector<int> sortedLms;
+		sortedLms.reserve((size_t)m);
+		for (int v : sa)
+		{
+			if (lmsMap[(size_t)v] != -1) sortedLms.push_back(v);
+		}
+		std::vector<int> names((size_t)m);
+		int upperName = 0;
+		names[(size_t)lmsMap[(size_t)sortedLms[0]]] = 0;
+		for (int i = 1; i < m; i++)
+		{
+			int l = sortedLms[(size_t)i - 1];
+			int r = sortedLms[(size_t)i];
+			int endL = (lmsMap[(size_t)l] + 1 < m) ? lms[(size_t)lmsMap[(size_t)l] + 1] : n;
+			int endR = (lmsMap[(size_t)r] + 1 < m) ? lms[(size_t)lmsMap[(size_t)r] + 1] : n;
+			bool same = (endL - l == endR - r);
+			if (same)
+			{
+				while ((l < endL) && (text[(size_t)l] == text[(size_t)r]))
+				{
+					l++;
+					r++;
+				}
+				same = (l != n) && (text[(size_t)l] == text[(size_t)r]);
+			}
+			if (!same) upperName++;
+			names[(size_t)lmsMap[(size_t)sortedLms[(size_t)i]]] = upperName;
+		}
+
+		std::vector<int> namesSa = buildSuffixArray(names, upperName);
+		for (int i = 0; i < m; i++)
+		{
+			sortedLms[(size_t)i] = lms[(size_t)namesSa[(size_t)i]];
+		}
+		induce(sortedLms);
+	}
+	return sa;
+}
+
+
+bool compressRangeOptimal(const unsigned char* start, const unsigned char* begin, const unsigned char* end, Encoder& encoder,
+						  int maxOffset, int maxMatch)
+{
+	// A string of length L can only use an offset of at least L, so a position has a string of every
+	// length up to its longest, all at the offset of the longest. The longest is found for each position
+	// from a suffix array of the window and the data: for each length L the suffixes sharing their first
+	// L bytes are adjacent in the array, and the nearest earlier member of a position's group at least L
+	// bytes back is the string of length L with the smallest offset. Strings can't be longer than the
+	// window, so this takes time proportional to the data for each length up to maxMatch or maxOffset.
+	int n = (int)(end - start);
+	int first = (int)(begin - start);
+	int longest = (maxMatch < maxOffset) ? maxMatch : maxOffset;
+	std::vector<int> text(start, end);
+	std::vector<int> sa = buildSuffixArray(text, 255);
+	text = std::vector<int>();
+
+	// Kasai's algorithm finds the common prefix of each suffix with the one before it in the array, and
+	// only prefixes up to the longest string matter
+	std::vector<int> rank((size_t)n);
+	std::vector<int> lcp((size_t)n);
+	for (int r = 0; r < n; r++)
+	{
+		rank[(size_t)sa[(size_t)r]] = r;
+	}
+	for (int i = 0, h = 0; i < n; i++)
+	{
+		if (h > 0) h--;
+		if (rank[(size_t)i] == 0) continue;
+		int j = sa[(size_t)rank[(size_t)i] - 1];
+		while ((h < longest) && (i + h < n) && (j + h < n) && (start[i + h] == start[j + h])) h++;
+		lcp[(size_t)rank[(size_t)i]] = h;
+	}
+
+	std::vector<unsigned short> bestLength((size_t)(n - first));
+	std::vector<unsigned short> bestOffset((size_t)(n - first));
+	std::vector<int>& group = rank;
+	std::vector<int> nearest((size_t)n);
+	for (int length = 3; length <= longest; length++)
+	{
+		int groups = 0;
+		for (int r = 0; r < n; r++)
+		{
+			if ((r == 0) || (lcp[(size_t)r] < length)) groups++;
+			group[(size_t)sa[(size_t)r]] = groups - 1;
+		}
+		std::fill(nearest.begin(), nearest.begin() + groups, -1);
+
+		// Earlier members less than length bytes back would overlap, so a position only becomes the
+		// nearest member of its group once the scan is length bytes past it
+		bool found = false;
+		for (int i = 0; i < n; i++)
+		{
+			if (i >= length)
+			{
+				nearest[(size_t)group[(size_t)(i - length)]] = i - length;
+			}
+			int j = nearest[(size_t)group[(size_t)i]];
+			if ((i >= first) && (j >= 0) && (i - j <= maxOffset) && (n - i >= length))
+			{
+				bestLength[(size_t)(i - first)] = (unsigned short)length;
+				bestOffset[(size_t)(i - first)] = (unsigned short)(i - j);
+				found = true;
+			}
+		}
+		if (!found) break;
+	}
+	sa = std::vector<int>();
+	lcp = std::vector<int>();
+
+	// Choose the cheapest way to encode the data from each position to the end, working backwards. A
+	// literal costs a flag bit and a byte, and a string a flag bit and 16 bits.
+	std::vector<long long> cost((size_t)(n - first) + 1);
+	std::vector<unsigned short> choice((size_t)(n - first));
+	for (int i = n - first - 1; i >= 0; i--)
+	{
+		cost[(size_t)i] = cost[(size_t)i + 1] + 9;
+		choice[(size_t)i] = 1;
+		for (int length = 3; length <= bestLength[(size_t)i]; length++)
+		{
+			if (cost[(size_t)(i + length)] + 17 <= cost[(size_t)i])
+			{
+				cost[(size_t)i] = cost[(size_t)(i + length)] + 17;
+				choice[(size_t)i] = (unsigned short)length;
+			}
+		}
+	}
+
+	for (int i = 0; i < n - first; )
+	{
+		if (choice[(size_t)i] > 2)
+		{
+			if (!encoder.string(choice[(size_t)i], bestOffset[(size_t)i])) return false;
+			i += choice[(size_t)i];
+		}
+		else
+		{
+			if (!encoder.literal(begin[i++])) return false;
+		}
+	}
+	return true;
+}
+
+
+bool compressRangeFast(const unsigned char* start, const unsigned char* begin, const unsigned char* end, Encoder& encoder,
+					   int maxOffset, int maxMatch, const CompressOptions& options)
+{
+	// The greedy parse of compressRange() with matches from a DoubleFast. As in LZ4, the longer the run
+	// of literals the more positions are passed over without being searched or indexed, so data that
+	// doesn't compress is soon passed through almost as fast as it can be encoded. Only the first and
+	// last positions of a string are indexed.
+	FILE* trace = options.trace;
+	DoubleFast tables(start, end, maxOffset, maxMatch);
+	const unsigned char* indexed = start;
+	if (options.dictionary)
+	{
+		indexed += tables.attach(*options.dictionary->tables());
+	}
+	tables.insert(indexed, (int)(begin - indexed));
+	auto current = begin;
+	int misses = 0;
+	while (current < end)
+	{
+		int bestOffset = 0;
+		int bestLength = tables.find(current, bestOffset);
+		if (trace)
+		{
+			traceToken(trace, start, current, end, maxOffset, maxMatch, bestLength, bestOffset, 2);
+		}
+
+		if (bestLength > 2)
+		{
+			if (!encoder.string(bestLength, bestOffset)) return false;
+			tables.insert(current, 1);
+			tables.insert(current + bestLength - 1, 1);
+			current += bestLength;
+			misses = 0;
+		}
+		else
+		{
+			tables.insert(current, 1);
+			int step = 1 + (misses++ >> 5);
+			for (int i = 0; (i < step) && (current < end); i++)
+			{
+				if (!encoder.literal(*current++)) return false;
+			}
+		}
+	}
+	return true;
+}
+
+
+bool compressRange(const unsigned char* start, const unsigned char* begin, const unsigned char* end, Encoder& encoder,
+				   int maxOffset, int maxMatch, const CompressOptions& options)
+{
+	// Compress the data from begin to end. Matches may refer back as far as start, so the data between
+	// start and begin acts as a dictionary that has already been sent. With a prepared dictionary that
+	// data must be the dictionary's, and its tables stand in for indexing it.
+	FILE* trace = options.trace;
+	if (options.dictionary && (begin - start != (long)options.dictionary->data().size()))
+	{
+		error("Data to compress must follow the prepared dictionary");
+	}
+	if (options.level == LEVEL_OPTIMAL)
+	{
+		return compressRangeOptimal(start, begin, end, encoder, maxOffset, maxMatch);
+	}
+	if (options.level == LEVEL_DOUBLE_FAST)
+	{
+		return compressRangeFast(start, begin, end, encoder, maxOffset, maxMatch, options);
+	}
+	if ((options.threads > 1) && !trace)
+	{
+		return compressRangeParallel(start, begin, end, encoder, maxOffset, maxMatch, options);
+	}
+
+	// Below the exhaustive level matches are found through hash chains
+	std::unique_ptr<HashChain> chains;
+	if (options.level < LEVEL_EXHAUSTIVE)
+	{
+		chains.reset(new HashChain(start, end, maxOffset, maxMatch, 2 << options.level, options.prefetchDistance,
+								   options.hashBits));
+		const unsigned char* indexed = start;
+		if (options.dictionary)
+		{
+			indexed += chains->attach(*options.dictionary->chains());
+			chains->prime(indexed);
+		}
+		chains->insert(indexed, (int)(begin - indexed));
+	}
+
+	auto current = begin;
+	while (current < end)
+	{
+		// Find the longest match in the search window
+		int bestOffset = 0;
+		int candidates = 0;
+		int bestLength = chains ? chains->find(current, bestOffset, candidates)
+								: findMatch(start, current, end, maxOffset, maxMatch, bestOffset, candidates);
+
+		// Index the positions covered by the next item
+		if (chains)
+		{
+			chains->insert(current, bestLength > 2 ? bestLength : 1);
+		}
+
+		// Record the decision if a trace was requested
+		if (trace)
+		{
+			traceToken(trace, start, current, end, maxOffset, maxMatch, bestLength, bestOffset, candidates);
+		}
+
+		// Did we find a matching string of more than 2 bytes?
+		if (bestLength > 2)
+		{
+			if (!encoder.string(bestLength, bestOffset)) return false;
+			current += bestLength;
+		}
+		else
+		{
+			if (!encoder.literal(*current++)) return false;
+		}
+	}
+	return true;
+}
+
+
+int compressStream(const void* input, int inputLength, void* output, int outputLength, int dictionaryLength,
+				   const CompressOptions& options, int* consumed)
+{
+	// Compress the input, or with consumed as much of it as fits, storing the length compressed there
+	validateOptions(dictionaryLength, options);
+	if (options.dictionary)
+	{
+		const CompressOptions& prepared = options.dictionary->options();
+		if ((options.dictionary->dictionaryLength() != dictionaryLength) || (prepared.level != options.level) ||
+			(prepared.hashBits != options.hashBits))
+		{
+			error ("Compression options must match those the dictionary was prepared with");
+		}
+	}
+
+	// Ensure the destination buffer is big enough for at least the header information
+	if (outputLength < ((int)(sizeof(int) * 2)))
+	{
+		error ("Destination buffer is too small");
+	}
+
+	// Write header data to the destination buffer
+	auto header = (int*) output;
+	*header++ = inputLength;		// Write the uncompressed data length
+	*header++ = dictionaryLength;	// Write the dictionary length
+
+	// Calculate the maximum offset and maximum match length for this dictionary length
+	int maxOffset = dictionaryLength + 2;
+	int maxMatch = (65536 / dictionaryLength) + 2;
+	int lengthShift = -1;
+	while (dictionaryLength) { lengthShift++; dictionaryLength >>= 1; }
+
+	if (options.trace)
+	{
+		fprintf(options.trace, "# length %d maxOffset %d maxMatch %d\n", inputLength, maxOffset, maxMatch);
+	}
+
+	// Compress data. With a dictionary the input is copied after it, and only that copy is needed to
+	// attach the dictionary as its tables are shared.
+	auto start = (const unsigned char*)input;
+	auto begin = start;
+	thread_local std::vector<unsigned char> window;
+	if (options.dictionary)
+	{
+		const std::vector<unsigned char>& dictionary = options.dictionary->data();
+		window.assign(dictionary.begin(), dictionary.end());
+		window.insert(window.end(), start, start + inputLength);
+		start = window.data();
+		begin = start + dictionary.size();
+	}
+	// The output is written a word at a time, so only whole words of it can be used
+	Encoder encoder(header, (int*)output + outputLength / (int)sizeof(int), lengthShift);
+	if (!compressRange(start, begin, begin + inputLength, encoder, maxOffset, maxMatch, options))
+	{
+		if (!consumed)
+		{
+			return false;
+		}
+		((int*)output)[0] = encoder.length();
+	}
+	encoder.finish();
+	if (consumed)
+	{
+		*consumed = encoder.length();
+	}
+
+	// Calculate and return the size of the compressed data
+	int compressedLength = (int)((char*)encoder.position() - (char*)output);
+	return compressedLength;
+}
+
+
+int compress(const void* input, int inputLength, void* output, int outputLength, int dictionaryLength,
+			 const CompressOptions& options = CompressOptions())
+{
+	return compressStream(input, inputLength, output, outputLength, dictionaryLength, options, nullptr);
+}
+
+
+// Compress as much of the input as fits in outputLength bytes, as LZ4_compress_destSize() does, rather
+// than failing when it doesn't all fit. inputLength is set to the number of bytes consumed, which the
+// returned stream decompresses to, so the rest of the input can follow in the next buffer.
+int compressToFit(const void* input, int& inputLength, void* output, int outputLength, int dictionaryLength,
+				  const CompressOptions& options = CompressOptions())
+{
+	validateOptions(dictionaryLength, options);
+	if (outputLength < ((int)(sizeof(int) * 2)))
+	{
+		error ("Destination buffer is too small");
+	}
+
+	// A string of maxMatch bytes takes 17 bits, so no more input than that could fit is considered,
+	// which keeps the cost of parsers that look at all of their input down when the output is small
+	long long maxMatch = (65536 / dictionaryLength) + 2;
+	long long limit = ((long long)outputLength * 8 / 17 + 1) * maxMatch;
+	int consumed = 0;
+	int compressedLength = compressStream(input, (int)std::min((long long)inputLength, limit), output, outputLength,
+										  dictionaryLength, options, &consumed);
+	inputLength = consumed;
+	return compressedLength;
+}
+
+
+// The state of the decoder part way through a compress() stream. Keeping the accumulators together lets
+// a stream be decoded one item at a time, wherever the output of each item needs to go.
+struct Decoder
+{
+	const int* current;
+	int offsetMask;
+	int lengthShift;
+	int lengthMask;
+
+	// Accumulators
+	int bits = 0;
+	int bytes = 0;
+	int strings = 0;
+	int bitMask = 0;
+	int byteCount = 0;
+	int stringCount = 0;
+
+	Decoder(const int* stream, int dictionaryLength) : current(stream)
+	{
+		// Calculate values needed to separate strings into their offset and length components
+		offsetMask = dictionaryLength - 1;
+		lengthShift = -1;
+		while (dictionaryLength) { lengthShift++; dictionaryLength >>= 1; }
+		lengthMask = ((~offsetMask) & 0xffff) >> lengthShift;
+	}
+
+	// Move past the next item without decoding it and return its length
+	int skip()
+	{
+		if (!bitMask)
+		{
+			bits = *current++;
+			bitMask = 1;
+		}
+
+		int length = 1;
+		if (bits & bitMask)
+		{
+			if (!stringCount)
+			{
+				strings = *current++;
+				stringCount = 2;
+			}
+			length = ((strings >> lengthShift) & lengthMask) + 3;
+			strings >>= 16;
+			stringCount--;
+		}
+		else
+		{
+			if (!byteCount)
+			{
+				bytes = *current++;
+				byteCount = 4;
+			}
+			bytes >>= 8;
+			byteCount--;
+		}
+
+		bitMask <<= 1;
+		return length;
+	}
+
+	// Move past the next item, returning its length and storing its offset for a string, or storing an
+	// offset of 0 and its value for a byte
+	int item(int& offset, unsigned char& value)
+	{
+		if (!bitMask)
+		{
+			bits = *current++;
+			bitMask = 1;
+		}
+
+		int length = 1;
+		offset = 0;
+		if (bits & bitMask)
+		{
+			if (!stringCount)
+			{
+				strings = *current++;
+				stringCount = 2;
+			}
+			offset = (strings & offsetMask) + 3;
+			length = ((strings >> lengthShift) & lengthMask) + 3;
+			strings >>= 16;
+			stringCount--;
+		}
+		else
+		{
+			if (!byteCount)
+			{
+				bytes = *current++;
+				byteCount = 4;
+			}
+			value = (unsigned char)(bytes & 0xff);
+			bytes >>= 8;
+			byteCount--;
+		}
+
+		bitMask <<= 1;
+		return length;
+	}
+
+	// Decode the next item like next(), but return -1 and reset the accumulators when the item is the
+	// marker written by Encoder::flush()
+	int nextOrFlush(unsigned char* buffer)
+	{
+		if (!bitMask)
+		{
+			bits = *current++;
+			bitMask = 1;
+		}
+		if (bits & bitMask)
+		{
+			if (!stringCount)
+			{
+				strings = *current++;
+				stringCount = 2;
+			}
+			if ((strings & 0xffff) == (lengthMask << lengthShift))
+			{
+				bitMask = 0;
+				byteCount = 0;
+				stringCount = 0;
+				return -1;
+			}
+		}
+		return next(buffer);
+	}
+
+	// Decode the next item like next(), but without branching on whether it is a byte or a string, so that
+	// a mispredicted branch doesn't hold up other decoders running alongside. Up to 32 bytes are always
+	// written, so this can only be used when maxMatch is no more than 32 and buffer has 32 bytes to spare.
+	int nextWide(unsigned char* buffer)
+	{
+		if (!bitMask)
+		{
+			bits = *current++;
+			bitMask = 1;
+		}
+
+		int isString = (bits & bitMask) != 0;
+		int word = *current;
+		int refillString = isString & (stringCount == 0);
+		int refillByte = (isString ^ 1) & (byteCount == 0);
+		current += refillString | refillByte;
+		strings = refillString ? word : strings;
+		stringCount = refillString ? 2 : stringCount;
+		bytes = refillByte ? word : bytes;
+		byteCount = refillByte ? 4 : byteCount;
+
+		// A byte is copied from the buffer onto itself and then written over
+		const unsigned char* source = buffer - (isString ? (strings & offsetMask) + 3 : 0);
+		int length = isString ? ((strings >> lengthShift) & lengthMask) + 3 : 1;
+		unsigned char first = isString ? source[0] : (unsigned char)(bytes & 0xff);
+		unsigned char copy[32];
+		memcpy(copy, source, sizeof(copy));
+		memcpy(buffer, copy, sizeof(copy));
+		buffer[0] = first;
+
+		strings >>= 16 & -isString;
+		stringCount -= isString;
+		bytes >>= 8 & (isString - 1);
+		byteCount -= isString ^ 1;
+		bitMask <<= 1;
+		return length;
+	}
+
+	// Decode the next item to buffer and return the number of bytes written
+	int next(unsigned char* buffer)
+	{
+		// If the bit accumulator is empty then fill it
+		if (!bitMask)
+		{
+			bits = *current++;
+			bitMask = 1;
+		}
+
+		// Is next item a byte or a string?
+		int length = 1;
+		if (bits & bitMask)
+		{
+			// If the string accumulator is empty then fill it
+			if (!stringCount)
+			{
+				strings = *current++;
+				stringCount = 2;
+			}
+
+			// It's a string, so copy it
+			unsigned char* p = buffer - (strings & offsetMask) - 3;
+			length = ((strings >> lengthShift) & lengthMask) + 3;
+			memcpy(buffer, p, (size_t)length);
+
+			strings >>= 16;
+			stringCount--;
+		}
+		else
+		{
+			// If the byte accumulator is empty then fill it
+			if (!byteCount)
+			{
+				bytes = *current++;
+				byteCount = 4;
+			}
+
+			// Write the next byte
+			*buffer = (unsigned char)(bytes & 0xff);
+
+			bytes >>= 8;
+			byteCount--;
+		}
+
+		// Shift bit mask for next data element
+		bitMask <<= 1;
+		return length;
+	}
+};
+
+
+void streamCopy(unsigned char* destination, const unsigned char* source, int length)
+{
+#ifdef __SSE2__
+	// Copy normally up to the first 16 byte aligned destination address, then bypass the cache
+	int head = (int)((16 - ((uintptr_t)destination & 15)) & 15);
+	if (head > length) head = length;
+	memcpy(destination, source, (size_t)head);
+	destination += head;
+	source += head;
+	length -= head;
+
+	while (length >= 64)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i*)source);
+		__m128i b = _mm_loadu_si128((const __m128i*)(source + 16));
+		__m128i c = _mm_loadu_si128((const __m128i*)(source + 32));
+		__m128i d = _mm_loadu_si128((const __m128i*)(source + 48));
+		_mm_stream_si128((__m128i*)destination, a);
+		_mm_stream_si128((__m128i*)(destination + 16), b);
+		_mm_stream_si128((__m128i*)(destination + 32), c);
+		_mm_stream_si128((__m128i*)(destination + 48), d);
+		destination += 64;
+		source += 64;
+		length -= 64;
+	}
+	while (length >= 16)
+	{
+		_mm_stream_si128((__m128i*)destination, _mm_loadu_si128((const __m128i*)source));
+		destination += 16;
+		source += 16;
+		length -= 16;
+	}
+#endif
+	memcpy(destination, source, (size_t)length);
+}
+
+
+void decodeNonTemporal(Decoder& decoder, unsigned char* output, int length, int maxOffset, int maxMatch)
+{
+	// Strings only ever copy from the last maxOffset bytes of output, so rather than decoding straight to
+	// the output the decoder works in a small window that stays in cache. Each time a chunk of the window
+	// is complete it is streamed to the output with non-temporal stores and the last maxOffset bytes are
+	// moved to the front of the window, ready for the strings that follow.
+	const int chunkLength = 256 * 1024;
+	int historyLength = (maxOffset + 63) & ~63;
+	std::vector<unsigned char> window((size_t)(historyLength + chunkLength + maxMatch));
+	unsigned char* base = window.data() + historyLength;
+	unsigned char* buffer = base;
+	int remaining = length;
+	while (remaining)
+	{
+		int itemLength = decoder.next(buffer);
+		buffer += itemLength;
+		remaining -= itemLength;
+
+		if (buffer - base >= chunkLength)
+		{
+			streamCopy(output, base, chunkLength);
+			output += chunkLength;
+			memmove(window.data(), base + chunkLength - historyLength, (size_t)(buffer - base - chunkLength + historyLength));
+			buffer -= chunkLength;
+		}
+	}
+	streamCopy(output, base, (int)(buffer - base));
+#ifdef __SSE2__
+	_mm_sfence();
+#endif
+}
+
+
+// A flag word and the byte and string words read for its 32 items can be decoded together. Where the
+// byte and string words fall depends only on the flags and on how many bytes and strings are left in the
+// accumulators, so the layout of the group is found with pdep, the bytes and strings are separated into
+// arrays, and then each run of bytes is written with a single copy and each string with a 64 byte copy.
+// Groups are decoded this way where the processor supports it, for streams whose strings are no more
+// than 64 bytes long and while the output has room for the longest possible group.
+enum DecodeKernel
+{
+	KERNEL_SCALAR,
+	KERNEL_AVX2,				// Uses AVX2 and BMI2
+	KERNEL_AVX512,				// Uses AVX-512 VBMI2 to separate the bytes and strings
+};
+
+
+bool hasAvx2()
+{
+#ifdef __SSE2__
+	static const bool supported = __builtin_cpu_supports("avx2");
+	return supported;
+#else
+	return false;
+#endif
+}
+
+
+DecodeKernel bestKernel()
+{
+#ifdef __SSE2__
+	static const DecodeKernel kernel =
+		(__builtin_cpu_supports("avx512vbmi2") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("bmi2"))
+		? KERNEL_AVX512
+		: ((__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2")) ? KERNEL_AVX2 : KERNEL_SCALAR);
+	return kernel;
+#else
+	return KERNEL_SCALAR;
+#endif
+}
+
+
+#ifdef __SSE2__
+struct GroupLayout
+{
+	int words;					// Number of words read after the flag word
+	unsigned stringWords;		// Bit i is set if word i is a string word and clear if it is a byte word
+};
+
+
+__attribute__((target("bmi,bmi2,popcnt")))
+inline GroupLayout groupLayout(unsigned flags, int byteCount, int stringCount)
+{
+	// A byte word is read by the bytes numbered byteCount, byteCount + 4, ... and a string word by the
+	// strings numbered stringCount, stringCount + 2, ..., so depositing those patterns into the bytes and
+	// strings of the group gives the items that read a word
+	unsigned reads = _pdep_u32(0x11111111u << byteCount, ~flags) | _pdep_u32(0x55555555u << stringCount, flags);
+	return { _mm_popcnt_u32(reads), _pext_u32(flags, reads) };
+}
+
+
+__attribute__((target("avx2,bmi,bmi2,popcnt")))
+int decodeGroupsAvx2(Decoder& decoder, unsigned char* buffer, int length)
+{
+	// Decode whole groups until the output is too near its end, returning the number of bytes written
+	alignas(32) unsigned char bytes[4 + 17 * 4 + 32];
+	alignas(32) unsigned short strings[1 + 17 * 2 + 1];
+	int limit = 32 * (decoder.lengthMask + 3) + 64;
+	unsigned char* p = buffer;
+	while (buffer + length - p >= limit)
+	{
+		// Separate the words of the group into bytes and strings following what is left in the accumulators
+		unsigned flags = (unsigned)decoder.current[0];
+		GroupLayout group = groupLayout(flags, decoder.byteCount, decoder.stringCount);
+		memcpy(bytes, &decoder.bytes, sizeof(int));
+		strings[0] = (unsigned short)decoder.strings;
+		int byteEnd = decoder.byteCount;
+		int stringEnd = decoder.stringCount;
+		for (int i = 0; i < group.words; i++)
+		{
+			int isString = (group.stringWords >> i) & 1;
+			memcpy(bytes + byteEnd, decoder.current + 1 + i, sizeof(int));
+			memcpy(strings + stringEnd, decoder.current + 1 + i, sizeof(int));
+			byteEnd += 4 - 4 * isString;
+			stringEnd += 2 * isString;
+		}
+
+		// Write each run of bytes up to the next string and then the string
+		int byte = 0;
+		int string = 0;
+		int item = 0;
+		for (unsigned remaining = flags; remaining; remaining &= remaining - 1)
+		{
+			int next = (int)_tzcnt_u32(remaining);
+			_mm256_storeu_si256((__m256i*)p, _mm256_loadu_si256((const __m256i*)(bytes + byte)));
+			p += next - item;
+			byte += next - item;
+			int code = strings[string++];
+			const unsigned char* source = p - (code & decoder.offsetMask) - 3;
+			__m256i low = _mm256_loadu_si256((const __m256i*)source);
+			__m256i high = _mm256_loadu_si256((const __m256i*)(source + 32));
+			_mm256_storeu_si256((__m256i*)p, low);
+			_mm256_storeu_si256((__m256i*)(p + 32), high);
+			p += ((code >> decoder.lengthShift) & decoder.lengthMask) + 3;
+			item = next + 1;
+		}
+		_mm256_storeu_si256((__m256i*)p, _mm256_loadu_si256((const __m256i*)(bytes + byte)));
+		p += 32 - item;
+		byte += 32 - item;
+
+		memcpy(&decoder.bytes, bytes + byte, sizeof(int));
+		decoder.byteCount = byteEnd - byte;
+		decoder.strings = strings[string];
+		decoder.stringCount = stringEnd - string;
+		decoder.current += 1 + group.words;
+	}
+	return (int)(p - buffer);
+}
+
+
+__attribute__((target("avx2,avx512f,avx512bw,avx512vbmi2,bmi,bmi2,popcnt")))
+int decodeGroupsAvx512(Decoder& decoder, unsigned char* buffer, int length)
+{
+	// As decodeGroupsAvx2(), but the words of a group are loaded into one vector and its bytes and strings
+	// are compressed out of it. A group that reads more than 16 words, which needs nearly every other item
+	// to be a string, is left for the caller.
+	alignas(64) unsigned char bytes[4 + 64];
+	alignas(64) unsigned short strings[1 + 32 + 1];
+	int limit = 32 * (decoder.lengthMask + 3) + 64;
+	unsigned char* p = buffer;
+	while (buffer + length - p >= limit)
+	{
+		unsigned flags = (unsigned)decoder.current[0];
+		GroupLayout group = groupLayout(flags, decoder.byteCount, decoder.stringCount);
+		if (group.words > 16)
+		{
+			break;
+		}
+		unsigned wordMask = (1u << group.words) - 1;
+		unsigned byteWords = ~group.stringWords & wordMask;
+		__m512i words = _mm512_maskz_loadu_epi32((__mmask16)wordMask, decoder.current + 1);
+		memcpy(bytes, &decoder.bytes, sizeof(int));
+		_mm512_storeu_si512(bytes + decoder.byteCount, _mm512_maskz_compress_epi8(_pdep_u64(byteWords, 0x1111111111111111ull) * 15, words));
+		strings[0] = (unsigned short)decoder.strings;
+		_mm512_storeu_si512(strings + decoder.stringCount, _mm512_maskz_compress_epi16(_pdep_u32(group.stringWords, 0x55555555u) * 3, words));
+		int byteEnd = decoder.byteCount + 4 * _mm_popcnt_u32(byteWords);
+		int stringEnd = decoder.stringCount + 2 * _mm_popcnt_u32(group.stringWords);
+
+		int byte = 0;
+		int string = 0;
+		int item = 0;
+		for (unsigned remaining = flags; remaining; remaining &= remaining - 1)
+		{
+			int next = (int)_tzcnt_u32(remaining);
+			_mm256_storeu_si256((__m256i*)p, _mm256_loadu_si256((const __m256i*)(bytes + byte)));
+			p += next - item;
+			byte += next - item;
+			int code = strings[string++];
+			_mm512_storeu_si512(p, _mm512_loadu_si512(p - (code & decoder.offsetMask) - 3));
+			p += ((code >> decoder.lengthShift) & decoder.lengthMask) + 3;
+			item = next + 1;
+		}
+		_mm256_storeu_si256((__m256i*)p, _mm256_loadu_si256((const __m256i*)(bytes + byte)));
+		p += 32 - item;
+		byte += 32 - item;
+
+		memcpy(&decoder.bytes, bytes + byte, sizeof(int));
+		decoder.byteCount = byteEnd - byte;
+		decoder.strings = strings[string];
+		decoder.stringCount = stringEnd - string;
+		decoder.current += 1 + group.words;
+	}
+	return (int)(p - buffer);
+}
+#endif
+
+
+void decodeItems(Decoder& decoder, unsigned char* buffer, int length, DecodeKernel kernel = bestKernel())
+{
+	// Decode length bytes to buffer, a group at a time where kernel can
+#ifdef __SSE2__
+	if ((kernel != KERNEL_SCALAR) && (decoder.lengthMask + 3 <= 64))
+	{
+		int limit = 32 * (decoder.lengthMask + 3) + 64;
+		while (length)
+		{
+			if (!decoder.bitMask && (length >= limit))
+			{
+				int written = (kernel == KERNEL_AVX512) ? decodeGroupsAvx512(decoder, buffer, length)
+														: decodeGroupsAvx2(decoder, buffer, length);
+				buffer += written;
+				length -= written;
+				if (!length) break;
+			}
+			int itemLength = decoder.next(buffer);
+			buffer += itemLength;
+			length -= itemLength;
+		}
+		return;
+	}
+#endif
+	while (length)
+	{
+		int itemLength = decoder.next(buffer);
+		buffer += itemLength;
+		length -= itemLength;
+	}
+}
+
+
+int decompress(const void* input, void* output, int outputBufferLength, bool nonTemporal = false)
+{
+	// Read the header information
+	auto current = (int*)input;
+	int  uncompressedLength = *current++;	// Read the uncompressed data length
+	int  dictionaryLength = *current++;		// Read the dictionary length
+
+	// Make sure the output buffer is big enough
+	if (outputBufferLength < uncompressedLength)
+	{
+		error ("Destination buffer is too small");
+	}
+
+	Decoder decoder(current, dictionaryLength);
+
+	// Outputs that won't be read again soon can be written without displacing the contents of the cache
+	if (nonTemporal)
+	{
+		decodeNonTemporal(decoder, (unsigned char*)output, uncompressedLength, dictionaryLength + 2, (65536 / dictionaryLength) + 2);
+		return uncompressedLength;
+	}
+
+	// Decompress data
+	decodeItems(decoder, (unsigned char*)output, uncompressedLength);
+	return uncompressedLength;
+}
+
+
+class DecoderDictionary
+{
+public:
+	// Holds the data that messages were compressed against for decompress(). Only the last maxOffset
+	// bytes can be referred to, so only those are kept.
+	DecoderDictionary(const void* data, int length, int dictionaryLength) : dictLength(dictionaryLength)
+	{
+		int maxOffset = dictionaryLength + 2;
+		auto p = (const unsigned char*)data;
+		bytes.assign(p + (length > maxOffset ? length - maxOffset : 0), p + length);
+	}
+
+	explicit DecoderDictionary(const PreparedDictionary& dictionary)
+		: bytes(dictionary.data()), dictLength(dictionary.dictionaryLength())
+	{
+	}
+
+	const std::vector<unsigned char>& data() const
+	{
+		return bytes;
+	}
+
+	int dictionaryLength() const
+	{
+		return dictLength;
+	}
+
+private:
+	std::vector<unsigned char> bytes;
+	int dictLength;
+};
+
+
+int decompress(const void* input, void* output, int outputBufferLength, const DecoderDictionary& dictionary)
+{
+	// Decompress a stream compressed against dictionary. Only strings in the first maxOffset bytes of
+	// output can copy from the dictionary, so those are decoded after a copy of it and the rest straight
+	// to the output.
+	auto current = (const int*)input;
+	int  uncompressedLength = *current++;
+	int  dictionaryLength = *current++;
+	if (outputBufferLength < uncompressedLength)
+	{
+		error ("Destination buffer is too small");
+	}
+	if (dictionaryLength != dictionary.dictionaryLength())
+	{
+		error ("Stream wasn't compressed with this dictionary");
+	}
+
+	Decoder decoder(current, dictionaryLength);
+	int maxOffset = dictionaryLength + 2;
+	int maxMatch = (65536 / dictionaryLength) + 2;
+	const std::vector<unsigned char>& bytes = dictionary.data();
+	std::vector<unsigned char> window(bytes);
+	window.resize(bytes.size() + (size_t)maxOffset + (size_t)maxMatch);
+	unsigned char* base = window.data() + bytes.size();
+	int length = 0;
+	while ((length < uncompressedLength) && (length < maxOffset))
+	{
+		length += decoder.next(base + length);
+	}
+	if (length > uncompressedLength)
+	{
+		error ("Corrupt compressed data");
+	}
+	memcpy(output, base, (size_t)length);
+
+	auto buffer = (unsigned char*)output + length;
+	int remaining = uncompressedLength - length;
+	while (remaining > 0)
+	{
+		int itemLength = decoder.next(buffer);
+		buffer += itemLength;
+		remaining -= itemLength;
+	}
+	return uncompressedLength;
+}
+
+
+int decompressParallel(const void* input, void* output, int outputBufferLength, int threads)
+{
+	// Where each item lands in the output and where its bits, bytes and strings are read from depend only
+	// on the flags and string lengths before it. A pass that skips through the stream without writing
+	// anything records the decoder state at the start of each chunk of output, and the chunks are then
+	// decoded in parallel. Strings that copy from outside their chunk, or from bytes of it that are still
+	// waiting on such a string, are put aside and copied afterwards in stream order, by which time
+	// everything they copy from has been written.
+	const int chunkLength = 1 << 20;
+	auto current = (const int*)input;
+	int  uncompressedLength = *current++;
+	int  dictionaryLength = *current++;
+	if ((threads < 2) || (uncompressedLength < 2 * chunkLength))
+	{
+		return decompress(input, output, outputBufferLength);
+	}
+	if (outputBufferLength < uncompressedLength)
+	{
+		error ("Destination buffer is too small");
+	}
+
+	struct Checkpoint
+	{
+		Decoder decoder;
+		int position;
+	};
+	std::vector<Checkpoint> checkpoints;
+	Decoder decoder(current, dictionaryLength);
+	int position = 0;
+	while (position < uncompressedLength)
+	{
+		if (position >= (int)checkpoints.size() * chunkLength)
+		{
+			checkpoints.push_back({ decoder, position });
+		}
+		position += decoder.skip();
+	}
+
+	struct Copy
+	{
+		int position;
+		int offset;
+		int length;
+	};
+	auto buffer = (unsigned char*)output;
+	int chunks = (int)checkpoints.size();
+	std::vector<std::vector<Copy>> deferred((size_t)chunks);
+	parallelFor(chunks, threads, [&](int chunk)
+	{
+		Decoder decoder = checkpoints[chunk].decoder;
+		int begin = checkpoints[chunk].position;
+		int end = (chunk + 1 < chunks) ? checkpoints[chunk + 1].position : uncompressedLength;
+		std::vector<unsigned char> ready((size_t)(end - begin));
+		int position = begin;
+		while (position < end)
+		{
+			int offset;
+			unsigned char value = 0;
+			int length = decoder.item(offset, value);
+			if (!offset)
+			{
+				buffer[position] = value;
+				ready[position - begin] = 1;
+			}
+			else
+			{
+				int source = position - offset;
+				bool available = (source >= begin);
+				for (int i = 0; available && (i < length); i++)
+				{
+					available = ready[source - begin + i];
+				}
+				if (available)
+				{
+					memcpy(buffer + position, buffer + source, (size_t)length);
+					memset(ready.data() + (position - begin), 1, (size_t)length);
+				}
+				else
+				{
+					deferred[chunk].push_back({ position, offset, length });
+				}
+			}
+			position += length;
+		}
+	});
+
+	for (auto& copies : deferred)
+	{
+		for (auto& copy : copies)
+		{
+			memcpy(buffer + copy.position, buffer + copy.position - copy.offset, (size_t)copy.length);
+		}
+	}
+	return uncompressedLength;
+}
+
+
+int getDecompressedLength(const void* input)
+{
+	return *(int*)input;
+}
+
+
+int getCompressedLength(const void* input, int inputLength)
+{
+	// Walk the bit flags and strings of the stream without producing any output to find where it ends.
+	// Returns -1 if the header is invalid or the stream is longer than inputLength; the decoder may read
+	// up to two words beyond inputLength before that is detected.
+	auto header = (const int*)input;
+	if (inputLength < (int)(sizeof(int) * 2))
+	{
+		return -1;
+	}
+	int remaining = header[0];
+	int dictionaryLength = header[1];
+	if ((remaining < 0) || (dictionaryLength < 4) || (dictionaryLength > 16384) || (dictionaryLength & (dictionaryLength - 1)))
+	{
+		return -1;
+	}
+
+	Decoder decoder(header + 2, dictionaryLength);
+	auto end = (const int*)((const char*)input + (inputLength & ~3));
+	while ((remaining > 0) && (decoder.current <= end))
+	{
+		remaining -= decoder.skip();
+	}
+	if ((remaining < 0) || (decoder.current > end))
+	{
+		return -1;
+	}
+	return (int)((const char*)decoder.current - (const char*)input);
+}
+
+
+// A block can be split into 2 to 4 lanes, each a compress() stream of its own slice of the block. Decoding
+// one stream is a single chain of dependent steps, as where each item goes depends on the one before, but
+// the lanes don't depend on each other so the decoder can advance them all in the same loop and the
+// processor can overlap their work. The output starts with the number of lanes and the length of each
+// lane's stream, and the streams follow one after another.
+const int MAX_LANES = 4;
+
+
+// Return the offset of the slice of a block of length bytes that is compressed in lane
+long long laneStart(long long length, int lanes, int lane)
+{
+	return length * lane / lanes;
+}
+
+
+// Compress input in lanes, returning the length of the output or 0 if the output buffer is too small
+int compressLanes(const void* input, int inputLength, void* output, int outputLength, int lanes, int dictionaryLength,
+				  const CompressOptions& options = CompressOptions())
+{
+	if ((lanes < 2) || (lanes > MAX_LANES))
+	{
+		error ("The number of lanes must be between 2 and 4");
+	}
+	int length = (int)sizeof(int) * (1 + lanes);
+	if (outputLength < length)
+	{
+		return 0;
+	}
+
+	auto header = (int*)output;
+	header[0] = lanes;
+	for (int lane = 0; lane < lanes; lane++)
+	{
+		int begin = (int)laneStart(inputLength, lanes, lane);
+		int end = (int)laneStart(inputLength, lanes, lane + 1);
+		if (outputLength - length < (int)(sizeof(int) * 2))
+		{
+			return 0;
+		}
+		int stored = compress((const unsigned char*)input + begin, end - begin, (unsigned char*)output + length,
+							  outputLength - length, dictionaryLength, options);
+		if (!stored)
+		{
+			return 0;
+		}
+		header[1 + lane] = stored;
+		length += stored;
+	}
+	return length;
+}
+
+
+template <int LANES>
+void decodeLanes(const Decoder* decoders, unsigned char* const* buffers, const int* remaining, int maxMatch)
+{
+	// The decoders are copied to locals that nothing else can point to, as otherwise every byte written
+	// to the output might have changed them and they would be reloaded from memory after each item
+	Decoder lane[MAX_LANES] = { decoders[0], decoders[1], decoders[LANES > 2 ? 2 : 0], decoders[LANES > 3 ? 3 : 0] };
+	unsigned char* buffer[LANES];
+	int left[LANES];
+	for (int i = 0; i < LANES; i++)
+	{
+		buffer[i] = buffers[i];
+		left[i] = remaining[i];
+	}
+
+	// An item written by nextWide() takes at most 32 bytes, so every lane can be advanced by as many items
+	// as the shortest remaining lane has room for without checking for the end of each lane. Strings from
+	// smaller dictionaries can be longer, and those lanes are only decoded one at a time.
+	while (maxMatch <= 32)
+	{
+		int shortest = left[0];
+		for (int i = 1; i < LANES; i++)
+		{
+			if (left[i] < shortest) shortest = left[i];
+		}
+		int items = shortest / 32;
+		if (items == 0)
+		{
+			break;
+		}
+		while (items--)
+		{
+			for (int i = 0; i < LANES; i++)
+			{
+				int length = lane[i].nextWide(buffer[i]);
+				buffer[i] += length;
+				left[i] -= length;
+			}
+		}
+	}
+
+	// Finish the lanes one at a time
+	for (int i = 0; i < LANES; i++)
+	{
+		while (left[i] > 0)
+		{
+			int length = lane[i].next(buffer[i]);
+			buffer[i] += length;
+			left[i] -= length;
+		}
+	}
+}
+
+
+// Check that input is a complete set of lanes for a block of outputLength bytes before it is given to
+// decompressLanes()
+bool isValidLanes(const void* input, int inputLength, int outputLength)
+{
+	auto header = (const int*)input;
+	if (inputLength < (int)sizeof(int))
+	{
+		return false;
+	}
+	int lanes = header[0];
+	if ((lanes < 2) || (lanes > MAX_LANES) || (inputLength < (int)sizeof(int) * (1 + lanes)))
+	{
+		return false;
+	}
+
+	int offset = (int)sizeof(int) * (1 + lanes);
+	for (int lane = 0; lane < lanes; lane++)
+	{
+		auto stream = (const unsigned char*)input + offset;
+		int stored = header[1 + lane];
+		if ((stored < 0) || (stored > inputLength - offset) || (getCompressedLength(stream, stored) != stored) ||
+			(getDecompressedLength(stream) != laneStart(outputLength, lanes, lane + 1) - laneStart(outputLength, lanes, lane)))
+		{
+			return false;
+		}
+		offset += stored;
+	}
+	return true;
+}
+
+
+int decompressLanes(const void* input, void* output, int outputLength)
+{
+	// Find where each lane's stream starts and the slice of the output it decodes to
+	auto header = (const int*)input;
+	int lanes = header[0];
+	std::vector<Decoder> decoders;
+	unsigned char* buffers[MAX_LANES];
+	int remaining[MAX_LANES];
+	int maxMatch = 0;
+	auto stream = (const unsigned char*)input + sizeof(int) * (size_t)(1 + lanes);
+	for (int lane = 0; lane < lanes; lane++)
+	{
+		int dictionaryLength = ((const int*)stream)[1];
+		decoders.emplace_back((const int*)stream + 2, dictionaryLength);
+		buffers[lane] = (unsigned char*)output + laneStart(outputLength, lanes, lane);
+		remaining[lane] = ((const int*)stream)[0];
+		if ((65536 / dictionaryLength) + 2 > maxMatch) maxMatch = (65536 / dictionaryLength) + 2;
+		stream += header[1 + lane];
+	}
+
+	switch (lanes)
+	{
+		case 2: decodeLanes<2>(decoders.data(), buffers, remaining, maxMatch); break;
+		case 3: decodeLanes<3>(decoders.data(), buffers, remaining, maxMatch); break;
+		case 4: decodeLanes<4>(decoders.data(), buffers, remaining, maxMatch); break;
+	}
+	return outputLength;
+}
+
+
+// Many small messages decompress faster together than one at a time. Most of the time spent on a small
+// message goes on the dependent steps that find its next item, so the batch decoder finds the next item
+// of 8 messages at once in the lanes of AVX2 vectors and then writes the 8 items. When a message is near
+// its end it is finished on its own and the next message in the batch takes over its lane.
+const int BATCH_LANES = 8;
+const int BATCH_TAIL = 32;			// Bytes at the end of each message that are decoded one item at a time
+
+#ifdef __SSE2__
+struct BatchState
+{
+	const int* current[BATCH_LANES];
+	unsigned char* buffer[BATCH_LANES];
+	alignas(32) int remaining[BATCH_LANES];
+	alignas(32) int bits[BATCH_LANES];
+	alignas(32) int bitMask[BATCH_LANES];
+	alignas(32) int bytes[BATCH_LANES];
+	alignas(32) int strings[BATCH_LANES];
+	alignas(32) int byteCount[BATCH_LANES];
+	alignas(32) int stringCount[BATCH_LANES];
+	alignas(32) int offsetMask[BATCH_LANES];
+	alignas(32) int lengthShift[BATCH_LANES];
+	alignas(32) int lengthMask[BATCH_LANES];
+
+	// Start decoding input to output in lane, or leave the lane empty if there is no input, in which case
+	// output is where the lane's empty items are written
+	void start(int lane, const void* input, void* output)
+	{
+		auto header = (const int*)input;
+		Decoder decoder(header ? header + 2 : nullptr, header ? header[1] : 4);
+		current[lane] = decoder.current;
+		buffer[lane] = (unsigned char*)output;
+		remaining[lane] = header ? header[0] : 0;
+		bits[lane] = bitMask[lane] = bytes[lane] = strings[lane] = byteCount[lane] = stringCount[lane] = 0;
+		offsetMask[lane] = decoder.offsetMask;
+		lengthShift[lane] = decoder.lengthShift;
+		lengthMask[lane] = decoder.lengthMask;
+	}
+
+	// Decode the rest of the message in lane one item at a time
+	void finish(int lane)
+	{
+		Decoder decoder(current[lane], 4);
+		decoder.offsetMask = offsetMask[lane];
+		decoder.lengthShift = lengthShift[lane];
+		decoder.lengthMask = lengthMask[lane];
+		decoder.bits = bits[lane];
+		decoder.bitMask = bitMask[lane];
+		decoder.bytes = bytes[lane];
+		decoder.strings = strings[lane];
+		decoder.byteCount = byteCount[lane];
+		decoder.stringCount = stringCount[lane];
+		while (remaining[lane] > 0)
+		{
+			int length = decoder.next(buffer[lane]);
+			buffer[lane] += length;
+			remaining[lane] -= length;
+		}
+	}
+};
+
+
+__attribute__((target("avx2")))
+__m256i gatherWords(__m256i current0, __m256i current1, __m256i mask)
+{
+	// Load the word at current in each lane selected by mask, and 0 in the others
+	__m128i low = _mm256_mask_i64gather_epi32(_mm_setzero_si128(), (const int*)nullptr, current0, _mm256_castsi256_si128(mask), 1);
+	__m128i high = _mm256_mask_i64gather_epi32(_mm_setzero_si128(), (const int*)nullptr, current1, _mm256_extracti128_si256(mask, 1), 1);
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+}
+
+
+__attribute__((target("avx2")))
+void advancePointers(__m256i& pointer0, __m256i& pointer1, __m256i step)
+{
+	// Add step to the pointer in each lane, with pointer0 holding lanes 0 to 3 and pointer1 lanes 4 to 7
+	pointer0 = _mm256_add_epi64(pointer0, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(step)));
+	pointer1 = _mm256_add_epi64(pointer1, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(step, 1)));
+}
+
+
+// The state of a BatchState while it is being decoded, held in vectors
+struct BatchVectors
+{
+	__m256i current0, current1, buffer0, buffer1;
+	__m256i remaining, bits, bitMask, bytes, strings, byteCount, stringCount;
+	__m256i offsetMask, lengthShift, lengthMask;
+	__m256i active;
+
+	__attribute__((target("avx2")))
+	bool load(const BatchState& state)
+	{
+		current0 = _mm256_loadu_si256((const __m256i*)state.current);
+		current1 = _mm256_loadu_si256((const __m256i*)(state.current + 4));
+		buffer0 = _mm256_loadu_si256((const __m256i*)state.buffer);
+		buffer1 = _mm256_loadu_si256((const __m256i*)(state.buffer + 4));
+		remaining = _mm256_load_si256((const __m256i*)state.remaining);
+		bits = _mm256_load_si256((const __m256i*)state.bits);
+		bitMask = _mm256_load_si256((const __m256i*)state.bitMask);
+		bytes = _mm256_load_si256((const __m256i*)state.bytes);
+		strings = _mm256_load_si256((const __m256i*)state.strings);
+		byteCount = _mm256_load_si256((const __m256i*)state.byteCount);
+		stringCount = _mm256_load_si256((const __m256i*)state.stringCount);
+		offsetMask = _mm256_load_si256((const __m256i*)state.offsetMask);
+		lengthShift = _mm256_load_si256((const __m256i*)state.lengthShift);
+		lengthMask = _mm256_load_si256((const __m256i*)state.lengthMask);
+		active = _mm256_cmpgt_epi32(remaining, _mm256_set1_epi32(BATCH_TAIL - 1));
+		return !_mm256_testz_si256(active, active);
+	}
+
+	__attribute__((target("avx2")))
+	void store(BatchState& state) const
+	{
+		_mm256_storeu_si256((__m256i*)state.current, current0);
+		_mm256_storeu_si256((__m256i*)(state.current + 4), current1);
+		_mm256_storeu_si256((__m256i*)state.buffer, buffer0);
+		_mm256_storeu_si256((__m256i*)(state.buffer + 4), buffer1);
+		_mm256_store_si256((__m256i*)state.remaining, remaining);
+		_mm256_store_si256((__m256i*)state.bits, bits);
+		_mm256_store_si256((__m256i*)state.bitMask, bitMask);
+		_mm256_store_si256((__m256i*)state.bytes, bytes);
+		_mm256_store_si256((__m256i*)state.strings, strings);
+		_mm256_store_si256((__m256i*)state.byteCount, byteCount);
+		_mm256_store_si256((__m256i*)state.stringCount, stringCount);
+	}
+
+	// Decode an item in every active lane, returning a bit mask of the lanes that have less than BATCH_TAIL
+	// bytes of their message left
+	__attribute__((target("avx2")))
+	int step()
+	{
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i one = _mm256_set1_epi32(1);
+		const __m256i three = _mm256_set1_epi32(3);
+
+		// Refill the bit accumulators that are empty
+		__m256i empty = _mm256_and_si256(active, _mm256_cmpeq_epi32(bitMask, zero));
+		if (!_mm256_testz_si256(empty, empty))
+		{
+			bits = _mm256_blendv_epi8(bits, gatherWords(current0, current1, empty), empty);
+			bitMask = _mm256_blendv_epi8(bitMask, one, empty);
+			advancePointers(current0, current1, _mm256_and_si256(empty, _mm256_set1_epi32(4)));
+		}
+
+		// Refill the byte or string accumulator that the next item needs
+		__m256i isString = _mm256_andnot_si256(_mm256_cmpeq_epi32(_mm256_and_si256(bits, bitMask), zero), active);
+		__m256i isByte = _mm256_andnot_si256(isString, active);
+		__m256i refillString = _mm256_and_si256(isString, _mm256_cmpeq_epi32(stringCount, zero));
+		__m256i refillByte = _mm256_and_si256(isByte, _mm256_cmpeq_epi32(byteCount, zero));
+		__m256i refill = _mm256_or_si256(refillString, refillByte);
+		if (!_mm256_testz_si256(refill, refill))
+		{
+			__m256i word = gatherWords(current0, current1, refill);
+			strings = _mm256_blendv_epi8(strings, word, refillString);
+			stringCount = _mm256_blendv_epi8(stringCount, _mm256_set1_epi32(2), refillString);
+			bytes = _mm256_blendv_epi8(bytes, word, refillByte);
+			byteCount = _mm256_blendv_epi8(byteCount, _mm256_set1_epi32(4), refillByte);
+			advancePointers(current0, current1, _mm256_and_si256(refill, _mm256_set1_epi32(4)));
+		}
+
+		// Separate the items and move the accumulators on past them
+		__m256i offset = _mm256_add_epi32(_mm256_and_si256(strings, offsetMask), three);
+		__m256i stringLength = _mm256_add_epi32(_mm256_and_si256(_mm256_srlv_epi32(strings, lengthShift), lengthMask), three);
+		__m256i length = _mm256_or_si256(_mm256_and_si256(isString, stringLength), _mm256_and_si256(isByte, one));
+		__m256i value = _mm256_and_si256(isByte, _mm256_and_si256(bytes, _mm256_set1_epi32(0xff)));
+		strings = _mm256_blendv_epi8(strings, _mm256_srli_epi32(strings, 16), isString);
+		stringCount = _mm256_add_epi32(stringCount, isString);
+		bytes = _mm256_blendv_epi8(bytes, _mm256_srli_epi32(bytes, 8), isByte);
+		byteCount = _mm256_add_epi32(byteCount, isByte);
+		bitMask = _mm256_blendv_epi8(bitMask, _mm256_slli_epi32(bitMask, 1), active);
+		remaining = _mm256_sub_epi32(remaining, length);
+
+		// Every byte or string is written as 32 bytes without a branch on which it is, in the same way as
+		// Decoder::nextWide(). A byte copies 32 zeros rather than the bytes just written to the buffer, as
+		// reading those back would have to wait for the write, and then its first byte is its value.
+		alignas(32) static const unsigned char zeroBytes[32] = {};
+		alignas(32) const unsigned char* sources[BATCH_LANES];
+		alignas(32) unsigned char* buffers[BATCH_LANES];
+		alignas(32) int values[BATCH_LANES];
+		__m256i zeros = _mm256_set1_epi64x((long long)(uintptr_t)zeroBytes);
+		__m256i source0 = _mm256_sub_epi64(buffer0, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(offset)));
+		__m256i source1 = _mm256_sub_epi64(buffer1, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(offset, 1)));
+		_mm256_store_si256((__m256i*)sources, _mm256_blendv_epi8(zeros, source0, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(isString))));
+		_mm256_store_si256((__m256i*)(sources + 4), _mm256_blendv_epi8(zeros, source1, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(isString, 1))));
+		_mm256_store_si256((__m256i*)buffers, buffer0);
+		_mm256_store_si256((__m256i*)(buffers + 4), buffer1);
+		_mm256_store_si256((__m256i*)values, value);
+		for (int lane = 0; lane < BATCH_LANES; lane++)
+		{
+			unsigned char first = (unsigned char)(sources[lane][0] | values[lane]);
+			_mm256_storeu_si256((__m256i*)buffers[lane], _mm256_loadu_si256((const __m256i*)sources[lane]));
+			buffers[lane][0] = first;
+		}
+		advancePointers(buffer0, buffer1, length);
+
+		__m256i done = _mm256_andnot_si256(_mm256_cmpgt_epi32(remaining, _mm256_set1_epi32(BATCH_TAIL - 1)), active);
+		active = _mm256_andnot_si256(done, active);
+		return _mm256_movemask_ps(_mm256_castsi256_ps(done));
+	}
+};
+
+
+__attribute__((target("avx2")))
+void decompressBatchAvx2(const void* const* inputs, void* const* outputs, int count)
+{
+	BatchState state;
+	BatchVectors vectors;
+	unsigned char sink[BATCH_TAIL];
+	int next = 0;
+	auto startNext = [&](int lane)
+	{
+		for (; next < count; next++)
+		{
+			// Strings from dictionaries smaller than 4 KB can be longer than the 32 bytes written for each
+			// item, so those messages are decompressed on their own along with short messages
+			auto header = (const int*)inputs[next];
+			if ((header[0] >= BATCH_TAIL) && (header[1] >= 4096))
+			{
+				state.start(lane, inputs[next], outputs[next]);
+				next++;
+				return;
+			}
+			decompress(inputs[next], outputs[next], header[0]);
+		}
+		state.start(lane, nullptr, sink);
+	};
+	for (int lane = 0; lane < BATCH_LANES; lane++)
+	{
+		startNext(lane);
+	}
+
+	// Decode until a message is near its end, then finish it and start the next message in its lane
+	while (vectors.load(state))
+	{
+		int finished = 0;
+		while (!finished)
+		{
+			finished = vectors.step();
+		}
+		vectors.store(state);
+		for (int lane = 0; lane < BATCH_LANES; lane++)
+		{
+			if (finished & (1 << lane))
+			{
+				state.finish(lane);
+				startNext(lane);
+			}
+		}
+	}
+}
+#endif
+
+
+// Decompress count independent compress() streams, each to the output with the same index. The AVX2
+// batch decoder is used where the processor supports it, otherwise each stream is decompressed in turn.
+void decompressBatch(const void* const* inputs, void* const* outputs, const int* outputLengths, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		if (outputLengths[i] < *(const int*)inputs[i])
+		{
+			error ("Destination buffer is too small");
+		}
+	}
+
+#ifdef __SSE2__
+	if (hasAvx2())
+	{
+		decompressBatchAvx2(inputs, outputs, count);
+		return;
+	}
+#endif
+	for (int i = 0; i < count; i++)
+	{
+		decompress(inputs[i], outputs[i], outputLengths[i]);
+	}
+}
+
+
+double now()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+double cpuTime()
+{
+	// Processor time used by all threads of the process, including time spent in the kernel
+	rusage usage = {};
+	getrusage(RUSAGE_SELF, &usage);
+	return (double)usage.ru_utime.tv_sec + (double)usage.ru_utime.tv_usec / 1e6 +
+		   (double)usage.ru_stime.tv_sec + (double)usage.ru_stime.tv_usec / 1e6;
+}
+
+
+struct Options
+{
+	bool stats = false;			// Report per-phase timings and throughput on completion
+	string trace;				// Write every parse decision made by the compressor to this file
+	bool direct = false;		// Write the output with O_DIRECT, bypassing the page cache
+	int level = LEVEL_EXHAUSTIVE;
+	int prefetchDistance = CompressOptions().prefetchDistance;
+	int threads = 1;			// Number of threads finding matches or decoding blocks
+	bool legacy = false;		// Write a single compress() stream rather than a frame
+	int readAhead = 0;			// Blocks decoded ahead of writing on a background thread, 0 for none
+	int lanes = 1;				// Independent streams each block is split into
+	bool detect = true;			// Choose how to compress each block from its content
+	bool resume = false;		// Checkpoint the job and continue from an earlier checkpoint
+	long long rangeOffset = 0;	// Compress only the range of the input starting here...
+	long long rangeLength = -1;	// ...and of this length, producing a segment for merging
+};
+
+
+struct Stats
+{
+	double start = 0;			// Wall clock time at which the job started
+	double startCpu = 0;		// Processor time used before the job started
+	double readTime = 0;		// Time spent reading the input file
+	double codeTime = 0;		// Time spent compressing or decompressing
+	double writeTime = 0;		// Time spent writing the output file
+	long long inputBytes = 0;
+	long long outputBytes = 0;
+};
+
+
+long long residentBytes(const string& path)
+{
+	// Map the file and ask which of its pages are held in the page cache
+	long long resident = 0;
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) return 0;
+	struct stat status = {};
+	fstat(fd, &status);
+	if (S_ISREG(status.st_mode) && (status.st_size > 0))
+	{
+		size_t length = (size_t)status.st_size;
+		void* map = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+		if (map != MAP_FAILED)
+		{
+			long pageLength = sysconf(_SC_PAGESIZE);
+			std::vector<unsigned char> pages((length + pageLength - 1) / pageLength);
+			if (mincore(map, length, pages.data()) == 0)
+			{
+				for (auto page : pages) resident += (page & 1) ? pageLength : 0;
+			}
+			munmap(map, length);
+		}
+	}
+	close(fd);
+	return resident;
+}
+
+
+void printStats(const Stats& stats, bool compressing, const string& output_file)
+{
+	double wall = now() - stats.start;
+	double cpu = cpuTime() - stats.startCpu;
+
+	// Throughput is always measured against the uncompressed size
+	long long uncompressed = compressing ? stats.inputBytes : stats.outputBytes;
+	long long compressed = compressing ? stats.outputBytes : stats.inputBytes;
+	double megabytes = (double)uncompressed / (1024.0 * 1024.0);
+
+	rusage usage = {};
+	getrusage(RUSAGE_SELF, &usage);
+
+	auto rate = [&](double seconds) { return seconds > 0 ? megabytes / seconds : 0.0; };
+	printf("  read        %10.3f s %10.1f MB/s\n", stats.readTime, rate(stats.readTime));
+	printf("  %-11s %10.3f s %10.1f MB/s\n", compressing ? "compress" : "decompress", stats.codeTime, rate(stats.codeTime));
+	printf("  write       %10.3f s %10.1f MB/s\n", stats.writeTime, rate(stats.writeTime));
+	printf("  total       %10.3f s %10.1f MB/s\n", wall, rate(wall));
+	printf("  input       %10lld bytes\n", stats.inputBytes);
+	printf("  output      %10lld bytes\n", stats.outputBytes);
+	printf("  ratio       %10.3f\n", compressed ? (double)uncompressed / (double)compressed : 0.0);
+	printf("  peak rss    %10.1f MB\n", (double)usage.ru_maxrss / 1024.0);
+	printf("  page cache  %10.1f MB of output resident\n", (double)residentBytes(output_file) / (1024.0 * 1024.0));
+	// CPU time across all threads divided by wall time gives the average number of busy threads
+	printf("  cpu         %10.3f s (%.2f threads busy)\n", cpu, wall > 0 ? cpu / wall : 0.0);
+}
+
+
+// A compress() stream whose length isn't known in advance is written as a series of sync flushed chunks
+// and marked with this uncompressed length in its header
+const int STREAM_LENGTH_UNKNOWN = -1;
+
+
+class StreamCompressor
+{
+public:
+	// Compresses a stream of messages. Each message is flushed so the decoder can produce all of it as
+	// soon as it arrives, while matches can still refer back into earlier messages.
+	explicit StreamCompressor(int dictionaryLength, const CompressOptions& options = CompressOptions())
+		: dictionaryLength(dictionaryLength), options(options)
+	{
+		validateOptions(dictionaryLength, options);
+		if (options.dictionary)
+		{
+			error("Prepared dictionaries can't be used with streams");
+		}
+
+		maxOffset = dictionaryLength + 2;
+		maxMatch = (65536 / dictionaryLength) + 2;
+		lengthShift = -1;
+		while (dictionaryLength) { lengthShift++; dictionaryLength >>= 1; }
+	}
+
+	// Return the largest output that compressing a message of inputLength bytes can produce
+	static int bound(int inputLength)
+	{
+		// Each literal costs 9 bits; the header, the flush marker and the partly filled words add a few more
+		return inputLength + (inputLength / 8) + 32;
+	}
+
+	// Compress a message and flush it, returning the length of the output or 0 if the output buffer is
+	// too small. The first output of the stream starts with a header.
+	int compress(const void* input, int inputLength, void* output, int outputLength)
+	{
+		auto next = (int*)output;
+		auto outputEnd = (int*)((unsigned char*)output + (outputLength & ~3));
+		if (!encoder)
+		{
+			if (outputLength < (int)(sizeof(int) * 2)) return 0;
+			*next++ = STREAM_LENGTH_UNKNOWN;
+			*next++ = this->dictionaryLength;
+			encoder.reset(new Encoder(next, outputEnd, lengthShift));
+		}
+		encoder->setPosition(next, outputEnd);
+
+		// The window holds the end of the previous messages followed by this one
+		int historyLength = (int)window.size();
+		window.insert(window.end(), (const unsigned char*)input, (const unsigned char*)input + inputLength);
+		const unsigned char* start = window.data();
+		if (!compressRange(start, start + historyLength, start + window.size(), *encoder, maxOffset, maxMatch, options) ||
+			!encoder->flush(maxMatch))
+		{
+			// The encoder is left part way through a message, so the stream can't continue
+			error("Destination buffer is too small");
+		}
+
+		if ((int)window.size() > maxOffset)
+		{
+			window.erase(window.begin(), window.end() - maxOffset);
+		}
+		return (int)((char*)encoder->position() - (char*)output);
+	}
+
+private:
+	int dictionaryLength;
+	CompressOptions options;
+	int maxOffset;
+	int maxMatch;
+	int lengthShift;
+	std::vector<unsigned char> window;
+	std::unique_ptr<Encoder> encoder;
+};
+
+
+class StreamDecompressor
+{
+public:
+	// Decompress a chunk produced by StreamCompressor::compress(), returning the length of the message
+	int decompress(const void* input, int inputLength, void* output, int outputLength)
+	{
+		auto current = (const int*)input;
+		auto end = (const int*)((const char*)input + (inputLength & ~3));
+		if (!decoder)
+		{
+			if ((inputLength < (int)(sizeof(int) * 2)) || (current[0] != STREAM_LENGTH_UNKNOWN) ||
+				(current[1] < 4) || (current[1] > 16384) || (current[1] & (current[1] - 1)))
+			{
+				error("Invalid stream header");
+			}
+			maxOffset = current[1] + 2;
+			maxMatch = (65536 / current[1]) + 2;
+			decoder.reset(new Decoder(current + 2, current[1]));
+			current += 2;
+			window.resize((size_t)maxOffset);
+		}
+		decoder->current = current;
+
+		// Strings may copy from earlier messages, so each message is decoded after the last maxOffset
+		// bytes of the stream and then moved to the output
+		size_t length = (size_t)maxOffset;
+		while (true)
+		{
+			if (window.size() < length + maxMatch)
+			{
+				window.resize(window.size() * 2 + maxMatch);
+			}
+			int itemLength = decoder->nextOrFlush(window.data() + length);
+			if (decoder->current > end)
+			{
+				error("Truncated stream");
+			}
+			if (itemLength < 0)
+			{
+				break;
+			}
+			length += itemLength;
+		}
+		if (decoder->current != end)
+		{
+			error("Data follows the end of the message");
+		}
+
+		int messageLength = (int)(length - maxOffset);
+		if (messageLength > outputLength)
+		{
+			error("Destination buffer is too small");
+		}
+		memcpy(output, window.data() + maxOffset, (size_t)messageLength);
+		memmove(window.data(), window.data() + length - maxOffset, (size_t)maxOffset);
+		return messageLength;
+	}
+
+private:
+	int maxOffset = 0;
+	int maxMatch = 0;
+	std::vector<unsigned char> window;
+	std::unique_ptr<Decoder> decoder;
+};
+
+
+// Pages of 4 KB or 16 KB, as held by a compressed memory cache, are compressed without the header of a
+// compress() stream. The page length is known to the caller and the dictionary length is fixed, so a
+// slot only starts with a 2 byte header holding the page type in its low 2 bits and the length of the
+// payload that follows in the rest. Raw pages have the page length implied, as 16 KB doesn't fit.
+enum PageType
+{
+	PAGE_ZERO = 0,			// Every byte of the page is zero and there is no payload
+	PAGE_FILLED = 1,		// The page repeats a 32-bit word, which is the payload
+	PAGE_RAW = 2,			// The payload is a copy of the page
+	PAGE_LZSS = 3			// The payload is the page compressed without a stream header
+};
+
+const int PAGE_HEADER_LENGTH = 2;
+const int PAGE_MAX_LENGTH = 16384;
+const int PAGE_DICTIONARY_LENGTH = 4096;
+
+
+CompressOptions pageOptions()
+{
+	// A page is too short for the exhaustive search or a full size hash table to pay off
+	CompressOptions options;
+	options.level = 4;
+	options.hashBits = 12;
+	return options;
+}
+
+
+void validatePageLength(int pageLength)
+{
+	if ((pageLength != 4096) && (pageLength != PAGE_MAX_LENGTH))
+	{
+		error("Page length must be 4096 or 16384 bytes");
+	}
+}
+
+
+// Return the number of bytes used by the compressed page in slot
+int getPageSlotLength(const void* slot, int pageLength)
+{
+	unsigned short header;
+	memcpy(&header, slot, sizeof(header));
+	int length = ((header & 3) == PAGE_RAW) ? pageLength : (header >> 2);
+	return PAGE_HEADER_LENGTH + length;
+}
+
+
+// Compress a page into slot, returning the number of bytes used or 0 if the slot is too small. A slot of
+// pageLength + PAGE_HEADER_LENGTH bytes is always large enough.
+int compressPage(const void* page, int pageLength, void* slot, int slotLength, const CompressOptions& options = pageOptions())
+{
+	validatePageLength(pageLength);
+	auto input = (const unsigned char*)page;
+
+	// Zero and same filled pages are common in memory, and a page repeats its first word exactly when it
+	// matches itself shifted by a word
+	int words[PAGE_MAX_LENGTH / sizeof(int)];
+	const void* payload = input;
+	int payloadLength = 0;
+	int type;
+	if (!memcmp(input, input + 4, (size_t)(pageLength - 4)))
+	{
+		memcpy(words, input, 4);
+		type = words[0] ? PAGE_FILLED : PAGE_ZERO;
+		payload = words;
+		payloadLength = words[0] ? 4 : 0;
+	}
+	else
+	{
+		// Give up as soon as the compressed page would be no smaller than the page itself
+		validateOptions(PAGE_DICTIONARY_LENGTH, options);
+		Encoder encoder(words, words + pageLength / sizeof(int) - 1, 12);
+		if (compressRange(input, input, input + pageLength, encoder, PAGE_DICTIONARY_LENGTH + 2,
+						  (65536 / PAGE_DICTIONARY_LENGTH) + 2, options))
+		{
+			encoder.finish();
+			type = PAGE_LZSS;
+			payload = words;
+			payloadLength = (int)((char*)encoder.position() - (char*)words);
+		}
+		else
+		{
+			type = PAGE_RAW;
+			payloadLength = pageLength;
+		}
+	}
+
+	if (slotLength < PAGE_HEADER_LENGTH + payloadLength)
+	{
+		return 0;
+	}
+	auto header = (unsigned short)((type == PAGE_RAW) ? type : (type | (payloadLength << 2)));
+	memcpy(slot, &header, sizeof(header));
+	memcpy((unsigned char*)slot + PAGE_HEADER_LENGTH, payload, (size_t)payloadLength);
+	return PAGE_HEADER_LENGTH + payloadLength;
+}
+
+
+// Decompress the page held in slot, returning the number of bytes of the slot used
+int decompressPage(const void* slot, void* page, int pageLength)
+{
+	validatePageLength(pageLength);
+	unsigned short header;
+	memcpy(&header, slot, sizeof(header));
+	int payloadLength = getPageSlotLength(slot, pageLength) - PAGE_HEADER_LENGTH;
+	auto payload = (const unsigned char*)slot + PAGE_HEADER_LENGTH;
+	auto output = (unsigned char*)page;
+	switch (header & 3)
+	{
+		case PAGE_ZERO:
+			memset(output, 0, (size_t)pageLength);
+			break;
+
+		case PAGE_FILLED:
+			for (int i = 0; i < pageLength; i += 4)
+			{
+				memcpy(output + i, payload, 4);
+			}
+			break;
+
+		case PAGE_RAW:
+			memcpy(output, payload, (size_t)pageLength);
+			break;
+
+		case PAGE_LZSS:
+		{
+			// The payload follows a 2 byte header, so it is copied to align its words for the decoder. A
+			// corrupt payload can hold a word for every 4 bytes of page plus its flags, so the words past the
+			// payload are zeroed rather than read from beyond the copy.
+			int words[PAGE_MAX_LENGTH / sizeof(int) + PAGE_MAX_LENGTH / 32 + 1];
+			int wordCount = pageLength / (int)sizeof(int) + pageLength / 32 + 1;
+			memcpy(words, payload, (size_t)payloadLength);
+			memset((char*)words + payloadLength, 0, (size_t)wordCount * sizeof(int) - (size_t)payloadLength);
+			Decoder decoder(words, PAGE_DICTIONARY_LENGTH);
+
+			// Decode into a window with zeroed history before the page and room for a string running past
+			// its end, so a corrupt item can't write outside it, and copy out just the page
+			const int maxOffset = PAGE_DICTIONARY_LENGTH + 2;
+			const int maxMatch = (65536 / PAGE_DICTIONARY_LENGTH) + 2;
+			unsigned char window[maxOffset + PAGE_MAX_LENGTH + maxMatch];
+			memset(window, 0, (size_t)maxOffset);
+			unsigned char* buffer = window + maxOffset;
+			int position = 0;
+			while (position < pageLength)
+			{
+				position += decoder.next(buffer + position);
+			}
+			if ((position != pageLength) || ((char*)decoder.current - (char*)words > payloadLength))
+			{
+				error("Corrupt compressed page");
+			}
+			memcpy(output, buffer, (size_t)pageLength);
+			break;
+		}
+	}
+	return PAGE_HEADER_LENGTH + payloadLength;
+}
+
+
+// Packs compressed pages into slabs. Each slab is divided into slots of one size class, the classes being
+// 32 bytes apart, so a page takes little more memory than its compressed length and a freed slot is
+// reused by the next page of a similar length. The length of a slot is read from its page header, so
+// releasing a slot only needs its address. Slots can be allocated and released from any thread.
+class PageAllocator
+{
+public:
+	PageAllocator(int pageLength)
+		: pageLength(pageLength), classes((size_t)((PAGE_HEADER_LENGTH + pageLength + CLASS_GRANULARITY - 1) / CLASS_GRANULARITY))
+	{
+		validatePageLength(pageLength);
+	}
+
+	// Return a slot with room for length bytes of compressed page
+	unsigned char* allocate(int length)
+	{
+		int index = (length - 1) / CLASS_GRANULARITY;
+		SizeClass& sizeClass = classes[(size_t)index];
+		std::lock_guard<std::mutex> lock(sizeClass.mutex);
+		if (sizeClass.free.empty())
+		{
+			int slotLength = (index + 1) * CLASS_GRANULARITY;
+			int count = (SLAB_LENGTH / slotLength > 1) ? SLAB_LENGTH / slotLength : 1;
+			sizeClass.slabs.emplace_back(new unsigned char[(size_t)count * slotLength]);
+			for (int slot = count - 1; slot >= 0; slot--)
+			{
+				sizeClass.free.push_back(sizeClass.slabs.back().get() + (size_t)slot * slotLength);
+			}
+			reservedBytes += (long long)count * slotLength;
+		}
+		unsigned char* slot = sizeClass.free.back();
+		sizeClass.free.pop_back();
+		usedBytes += length;
+		return slot;
+	}
+
+	// Return a slot holding a compressed page to its size class
+	void release(unsigned char* slot)
+	{
+		int length = getPageSlotLength(slot, pageLength);
+		SizeClass& sizeClass = classes[(size_t)((length - 1) / CLASS_GRANULARITY)];
+		std::lock_guard<std::mutex> lock(sizeClass.mutex);
+		sizeClass.free.push_back(slot);
+		usedBytes -= length;
+	}
+
+	// Bytes of memory held in slabs
+	long long reserved() const
+	{
+		return reservedBytes;
+	}
+
+	// Bytes of the slabs holding compressed pages
+	long long used() const
+	{
+		return usedBytes;
+	}
+
+private:
+	static const int CLASS_GRANULARITY = 32;
+	static const int SLAB_LENGTH = 64 * 1024;
+
+	struct SizeClass
+	{
+		std::mutex mutex;
+		std::vector<std::unique_ptr<unsigned char[]>> slabs;
+		std::vector<unsigned char*> free;
+	};
+
+	int pageLength;
+	std::vector<SizeClass> classes;
+	std::atomic<long long> reservedBytes{0};
+	std::atomic<long long> usedBytes{0};
+};
+
+
+// The command line tool stores files in frames. A frame starts with a FrameHeader and is followed by a
+// sequence of blocks, each introduced by a BlockHeader, ending with a BLOCK_END header. Blocks are
+// compressed independently so the memory required doesn't depend on the size of the file, and runs of
+// zeros such as the holes in sparse files are stored as a BLOCK_ZERO header without any payload.
+// Frames can be concatenated, and a file compressed in ranges on separate machines can be joined by
+// merging the frames of the ranges into one.
+// Files written by earlier versions hold a single compress() stream; these start with a non-negative
+// uncompressed length, while the frame magic is negative, so both can be told apart when decompressing.
+
+const int FRAME_MAGIC = (int)0x89535A4C;		// "LZS\x89" when stored little endian
+const int FRAME_VERSION = 1;
+
+struct FrameHeader
+{
+	int magic;
+	int version;
+	int dictionaryLength;		// Default for the blocks, each of which records the length it was compressed with
+	int blockLength;			// Maximum uncompressed length of a BLOCK_LZSS, BLOCK_RAW, BLOCK_LANES or BLOCK_FILTERED block
+};
+
+enum BlockType
+{
+	BLOCK_END = 0,				// End of frame
+	BLOCK_LZSS = 1,				// Payload is the output of compress()
+	BLOCK_RAW = 2,				// Payload is stored uncompressed because compression didn't reduce it
+	BLOCK_ZERO = 3,				// No payload, decodes to rawLength zero bytes
+	BLOCK_SEGMENT = 4,			// No payload, the frame holds the range of a file starting at rawLength
+	BLOCK_INDEX = 5,			// Payload is an IndexEntry for every data block in the frame
+	BLOCK_LANES = 6,			// Payload is the output of compressLanes()
+	BLOCK_FILTERED = 7,			// Payload is the BlockFilter applied and then the output of compress()
+	BLOCK_MEMBERS = 8,			// Payload is the compress()ed member table of an archive
+};
+
+struct BlockHeader
+{
+	int type;
+	int storedLength;			// Length of the payload following the header
+	long long rawLength;		// Length of the data once decoded
+};
+
+// The blocks of a frame are followed by a trailer holding metadata blocks such as the index. The
+// storedLength of the BLOCK_END header gives the length of the trailer and its rawLength the length of
+// the frame once decoded, so the trailer can be found by reading backwards from the end of the file.
+struct IndexEntry
+{
+	long long rawOffset;		// Offset of the block's data in the decoded frame
+	long long frameOffset;		// Offset of the block's header from the start of the frame
+};
+
+
+class InputFile
+{
+public:
+	// An optional file that doesn't exist reads as empty
+	explicit InputFile(const string& path, bool optional = false) : path(path)
+	{
+		fd = open(path.c_str(), O_RDONLY);
+		if ((fd < 0) && optional && (errno == ENOENT))
+		{
+			return;
+		}
+		if (fd < 0)
+		{
+			error("Unable to open input file " + path);
+		}
+		struct stat status = {};
+		fstat(fd, &status);
+		length = (long long)status.st_size;
+	}
+
+	~InputFile()
+	{
+		if (fd >= 0) close(fd);
+	}
+
+	long long size() const
+	{
+		return length;
+	}
+
+	// Return the offset of the first byte at or after offset that is backed by data. Everything in
+	// between is a hole. File systems that don't report holes treat the whole file as data.
+	long long nextData(long long offset) const
+	{
+#ifdef SEEK_DATA
+		off_t data = lseek(fd, (off_t)offset, SEEK_DATA);
+		if (data >= 0) return (long long)data;
+		if (errno == ENXIO) return length;		// only a hole remains
+#endif
+		return offset;
+	}
+
+	// Return the offset of the first hole at or after offset, or the end of the file
+	long long nextHole(long long offset) const
+	{
+#ifdef SEEK_HOLE
+		off_t hole = lseek(fd, (off_t)offset, SEEK_HOLE);
+		if (hole >= 0) return (long long)hole;
+#endif
+		return length;
+	}
+
+	// Read exactly length bytes from offset, returning false if the file ends first
+	bool read(long long offset, void* buffer, long long length) const
+	{
+		if ((fd < 0) || (offset < 0)) return length <= 0;
+		auto p = (char*)buffer;
+		while (length > 0)
+		{
+			ssize_t count = pread(fd, p, (size_t)length, (off_t)offset);
+			if (count < 0 && errno == EINTR) continue;
+			if (count < 0) error("Unable to read input file " + path);
+			if (count == 0) return false;
+			p += count;
+			offset += count;
+			length -= count;
+		}
+		return true;
+	}
+
+private:
+	string path;
+	int fd = -1;
+	long long length = 0;
+};
+
+
+bool writeAt(int fd, const char* buffer, long long length, long long offset)
+{
+	while (length > 0)
+	{
+		ssize_t count = pwrite(fd, buffer, (size_t)length, (off_t)offset);
+		if (count < 0 && errno == EINTR) continue;
+		if (count <= 0) return false;
+		buffer += count;
+		offset += count;
+		length -= count;
+	}
+	return true;
+}
+
+
+class OutputFile
+{
+public:
+	// Direct output bypasses the page cache so that writing a large file doesn't evict the cached data
+	// of other processes. O_DIRECT requires aligned buffers, offsets and lengths, so the data is gathered
+	// into one of two aligned buffers and written from there; while one buffer is being written by a
+	// background thread the caller fills the other.
+	static const int DIRECT_ALIGNMENT = 4096;
+	static const int DIRECT_BUFFER_LENGTH = 4 << 20;
+
+	// A resumed file keeps its first resumeAt bytes and is written from there; it can't be direct
+	explicit OutputFile(const string& path, bool direct = false, long long resumeAt = -1) : path(path)
+	{
+		int flags = O_WRONLY | O_CREAT | ((resumeAt < 0) ? O_TRUNC : 0);
+#ifdef O_DIRECT
+		if (direct)
+		{
+			fd = open(path.c_str(), flags | O_DIRECT, 0666);
+			if (fd >= 0)
+			{
+				this->direct = true;
+				for (auto& buffer : buffers)
+				{
+					if (posix_memalign((void**)&buffer, DIRECT_ALIGNMENT, DIRECT_BUFFER_LENGTH) != 0)
+					{
+						error("Out of memory");
+					}
+				}
+			}
+			else
+			{
+				cout << "Direct output is not supported for " << path << ", using buffered output" << endl;
+			}
+		}
+#endif
+		if (fd < 0)
+		{
+			fd = open(path.c_str(), flags, 0666);
+		}
+		if (fd < 0)
+		{
+			error("Unable to open output file " + path);
+		}
+		struct stat status = {};
+		fstat(fd, &status);
+		regular = S_ISREG(status.st_mode);
+		if ((resumeAt >= 0) && ((ftruncate(fd, (off_t)resumeAt) != 0) || (lseek(fd, (off_t)resumeAt, SEEK_SET) < 0)))
+		{
+			error("Unable to resume output file " + path);
+		}
+		position = (resumeAt < 0) ? 0 : resumeAt;
+	}
+
+	~OutputFile()
+	{
+		finish();
+		for (auto buffer : buffers) free(buffer);
+	}
+
+	void write(const void* buffer, long long length)
+	{
+		auto p = (const char*)buffer;
+		if (direct)
+		{
+			while (length > 0)
+			{
+				long long count = DIRECT_BUFFER_LENGTH - fill;
+				if (count > length) count = length;
+				memcpy(buffers[active] + fill, p, (size_t)count);
+				fill += (int)count;
+				p += count;
+				length -= count;
+				position += count;
+				if (fill == DIRECT_BUFFER_LENGTH) submit();
+			}
+			return;
+		}
+
+		while (length > 0)
+		{
+			ssize_t count = ::write(fd, p, (size_t)length);
+			if (count < 0 && errno == EINTR) continue;
+			if (count <= 0) error("Unable to write output file " + path);
+			p += count;
+			length -= count;
+			position += count;
+		}
+	}
+
+	// Advance the output by length zero bytes. Regular files are left with a hole by seeking past the
+	// range, other seekable outputs such as block devices have the range punched out, and anything
+	// else is sent real zeros.
+	void skip(long long length)
+	{
+		if (length <= 0) return;
+		if (direct)
+		{
+			if (regular)
+			{
+				// Zeros are buffered up to the next aligned offset, then the buffered data is written
+				// and the aligned part of the range is skipped by starting the next write beyond it
+				long long pad = (DIRECT_ALIGNMENT - (fill % DIRECT_ALIGNMENT)) % DIRECT_ALIGNMENT;
+				if (pad > length) pad = length;
+				writeZeros(pad);
+				length -= pad;
+
+				long long hole = length & ~(long long)(DIRECT_ALIGNMENT - 1);
+				if (hole)
+				{
+					submit();
+					offset += hole;
+					position += hole;
+					length -= hole;
+				}
+			}
+			writeZeros(length);
+			return;
+		}
+
+		bool skipped = regular;
+#ifdef FALLOC_FL_PUNCH_HOLE
+		if (!skipped)
+		{
+			skipped = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)position, (off_t)length) == 0;
+		}
+#endif
+		if (skipped && lseek(fd, (off_t)length, SEEK_CUR) >= 0)
+		{
+			position += length;
+			return;
+		}
+		writeZeros(length);
+	}
+
+	// Make the data written so far durable. Direct output still buffered isn't included.
+	void sync()
+	{
+		if (fdatasync(fd) != 0)
+		{
+			error("Unable to sync output file " + path);
+		}
+	}
+
+	// Set the length of a file that ends in a hole and close it
+	void finish()
+	{
+		if (fd < 0) return;
+		if (direct)
+		{
+			// Write the aligned part of the last buffer directly and the unaligned tail through the page cache
+			int tail = fill % DIRECT_ALIGNMENT;
+			fill -= tail;
+			const char* tailData = buffers[active] + fill;
+			submit();
+			wait();
+			if (tail)
+			{
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+				if (!writeAt(fd, tailData, tail, offset))
+				{
+					error("Unable to write output file " + path);
+				}
+			}
+		}
+		if (regular && ftruncate(fd, (off_t)position) != 0)
+		{
+			error("Unable to write output file " + path);
+		}
+		close(fd);
+		fd = -1;
+	}
+
+private:
+	void writeZeros(long long length)
+	{
+		static const char zeros[65536] = {};
+		while (length > 0)
+		{
+			long long count = length < (long long)sizeof(zeros) ? length : (long long)sizeof(zeros);
+			write(zeros, count);
+			length -= count;
+		}
+	}
+
+	// Start writing the active buffer in the background and switch to the other buffer once its own
+	// write has completed
+	void submit()
+	{
+		wait();
+		if (fill)
+		{
+			int descriptor = fd;
+			char* buffer = buffers[active];
+			int length = fill;
+			long long at = offset;
+			pending = std::async(std::launch::async, [=]() { return writeAt(descriptor, buffer, length, at); });
+			offset += fill;
+			active ^= 1;
+			fill = 0;
+		}
+	}
+
+	void wait()
+	{
+		if (pending.valid() && !pending.get())
+		{
+			error("Unable to write output file " + path);
+		}
+	}
+
+	string path;
+	int fd = -1;
+	bool regular = false;
+	long long position = 0;
+
+	bool direct = false;
+	char* buffers[2] = {};
+	int active = 0;				// Buffer being filled by the caller
+	int fill = 0;				// Length of the data in the active buffer
+	long long offset = 0;		// File offset at which the active buffer will be written
+	std::future<bool> pending;	// Write of the other buffer
+};
+
+
+bool isZero(const unsigned char* buffer, int length)
+{
+	return (length == 0) || ((buffer[0] == 0) && (memcmp(buffer, buffer + 1, (size_t)length - 1) == 0));
+}
+
+
+class FrameWriter
+{
+public:
+	// Writes a frame to output: the header, then blocks as they are added, then a trailer holding the
+	// block index and the BLOCK_END header. Runs of zeros are accumulated so that adjacent holes and
+	// zero blocks become a single BLOCK_ZERO.
+	FrameWriter(OutputFile& output, int dictionaryLength, int blockLength) : output(output)
+	{
+		FrameHeader frame = { FRAME_MAGIC, FRAME_VERSION, dictionaryLength, blockLength };
+		output.write(&frame, sizeof(frame));
+		length += sizeof(frame);
+	}
+
+	// Continue a frame already written up to length bytes, holding the blocks in index
+	FrameWriter(OutputFile& output, const std::vector<IndexEntry>& index, long long length, long long rawOffset)
+		: output(output), length(length), rawOffset(rawOffset), index(index)
+	{
+	}
+
+	// Record that the frame holds the range of a larger file starting at offset
+	void segment(long long offset)
+	{
+		BlockHeader header = { BLOCK_SEGMENT, 0, offset };
+		output.write(&header, sizeof(header));
+		length += sizeof(header);
+	}
+
+	void zeros(long long rawLength)
+	{
+		pendingZeros += rawLength;
+	}
+
+	void block(int type, const void* payload, int storedLength, long long rawLength)
+	{
+		if (type == BLOCK_ZERO)
+		{
+			zeros(rawLength);
+			return;
+		}
+		writeZeros();
+		write(type, payload, storedLength, rawLength);
+	}
+
+	// Add a metadata block to be written in the trailer ahead of the index
+	void metadata(int type, const void* payload, int storedLength, long long rawLength)
+	{
+		BlockHeader header = { type, storedLength, rawLength };
+		trailer.insert(trailer.end(), (const unsigned char*)&header, (const unsigned char*)(&header + 1));
+		trailer.insert(trailer.end(), (const unsigned char*)payload, (const unsigned char*)payload + storedLength);
+	}
+
+	// Return the index of the blocks written so far, after writing any pending run of zeros
+	const std::vector<IndexEntry>& blocks()
+	{
+		writeZeros();
+		return index;
+	}
+
+	// Write any trailing run of zeros and the trailer
+	void finish()
+	{
+		writeZeros();
+		output.write(trailer.data(), (long long)trailer.size());
+		long long trailerLength = (long long)trailer.size() + sizeof(BlockHeader) + (long long)(index.size() * sizeof(IndexEntry));
+		BlockHeader header = { BLOCK_INDEX, (int)(index.size() * sizeof(IndexEntry)), 0 };
+		output.write(&header, sizeof(header));
+		output.write(index.data(), header.storedLength);
+		BlockHeader end = { BLOCK_END, (int)trailerLength, rawOffset };
+		output.write(&end, sizeof(end));
+		length += trailerLength + sizeof(end);
+	}
+
+	// Return the number of bytes written so far
+	long long size() const
+	{
+		return length;
+	}
+
+	// Return the uncompressed length of the blocks written so far, not counting a pending run of zeros
+	long long rawSize() const
+	{
+		return rawOffset;
+	}
+
+private:
+	void writeZeros()
+	{
+		if (pendingZeros)
+		{
+			long long rawLength = pendingZeros;
+			pendingZeros = 0;
+			write(BLOCK_ZERO, nullptr, 0, rawLength);
+		}
+	}
+
+	void write(int type, const void* payload, int storedLength, long long rawLength)
+	{
+		index.push_back({ rawOffset, length });
+		BlockHeader header = { type, storedLength, rawLength };
+		output.write(&header, sizeof(header));
+		output.write(payload, storedLength);
+		length += sizeof(header) + storedLength;
+		rawOffset += rawLength;
+	}
+
+	OutputFile& output;
+	long long length = 0;			// Bytes written to the frame
+	long long rawOffset = 0;		// Uncompressed length of the blocks written
+	long long pendingZeros = 0;
+	std::vector<IndexEntry> index;
+	std::vector<unsigned char> trailer;		// Metadata blocks other than the index
+};
+
+
+void compressLegacy(const InputFile& input, OutputFile& output, long long rangeStart, long long rangeEnd,
+					int dictionaryLength, const CompressOptions& options, Stats& stats)
+{
+	// The whole range becomes one stream, as written by compress() before frames were introduced. Each
+	// literal costs at most 9 bits, so the output can't be more than an eighth larger than the input.
+	long long length = rangeEnd - rangeStart;
+	if (length > (INT32_MAX - 64) / 9 * 8)
+	{
+		error("Input is too large to compress as a single stream");
+	}
+	int compressedLength = (int)(length + length / 8 + 64);
+	std::vector<unsigned char> data((size_t)length);
+	std::vector<unsigned char> compressed((size_t)compressedLength);
+
+	double time = now();
+	if (!input.read(rangeStart, data.data(), (int)length))
+	{
+		error("Input file changed while compressing");
+	}
+	stats.readTime += now() - time;
+
+	time = now();
+	int storedLength = compress(data.data(), (int)length, compressed.data(), compressedLength, dictionaryLength, options);
+	stats.codeTime += now() - time;
+	if (storedLength <= 0)
+	{
+		error("Failed to compress input");
+	}
+
+	time = now();
+	output.write(compressed.data(), storedLength);
+	output.finish();
+	stats.writeTime += now() - time;
+	stats.outputBytes = storedLength;
+}
+
+
+// Each block is classified from a sample before it is compressed. Data that is already compressed is
+// stored raw without trying to compress it. Tables of numbers are delta filtered so that values that
+// change slowly become runs of small differences, and x86 machine code has the relative targets of its
+// calls and jumps made absolute so that calls to the same function match. A filter is only used if it
+// makes part of the sample smaller, and the dictionary length is chosen in the same way, as a small
+// dictionary allows longer strings and a large one reaches further back.
+enum BlockFilter
+{
+	FILTER_DELTA = 1,			// Bits 8 to 15 hold the distance of the byte subtracted from each byte
+	FILTER_X86 = 2,
+};
+
+
+struct BlockPlan
+{
+	bool store = false;			// Store the block raw without compressing it
+	int filter = 0;				// The BlockFilter to apply, or 0 for none
+	int dictionaryLength = 8192;
+};
+
+
+bool isValidFilter(int filter)
+{
+	return ((filter & 0xff) == FILTER_X86 && (filter >> 8) == 0) ||
+		   ((filter & 0xff) == FILTER_DELTA && (filter >> 8) >= 1 && (filter >> 8) <= 255);
+}
+
+
+void applyFilter(unsigned char* data, int length, int filter, bool encode)
+{
+	if ((filter & 0xff) == FILTER_DELTA)
+	{
+		int distance = filter >> 8;
+		if (encode)
+		{
+			for (int i = length - 1; i >= distance; i--) data[i] = (unsigned char)(data[i] - data[i - distance]);
+		}
+		else
+		{
+			for (int i = distance; i < length; i++) data[i] = (unsigned char)(data[i] + data[i - distance]);
+		}
+	}
+	else if ((filter & 0xff) == FILTER_X86)
+	{
+		// The operand of an E8 call or E9 jump is converted when its top byte is 0 or 0xff, as it is for a
+		// target within 16 MB, and the result is kept within the same range so that the decoder makes the
+		// same choice. Operands are skipped whether or not they are converted, so both see the same opcodes.
+		for (int i = 0; i + 5 <= length; )
+		{
+			if ((data[i] & 0xfe) != 0xe8)
+			{
+				i++;
+				continue;
+			}
+			uint32_t value;
+			memcpy(&value, data + i + 1, sizeof(value));
+			if (((value >> 24) == 0) || ((value >> 24) == 0xff))
+			{
+				uint32_t position = (uint32_t)(i + 5);
+				value = encode ? value + position : value - position;
+				value = (uint32_t)((int32_t)(value << 7) >> 7);
+				memcpy(data + i + 1, &value, sizeof(value));
+			}
+			i += 5;
+		}
+	}
+}
+
+
+double entropy(const int* histogram, int total)
+{
+	// Return the number of bits per byte needed to code bytes with these frequencies
+	double bits = 0;
+	for (int i = 0; i < 256; i++)
+	{
+		if (histogram[i]) bits -= histogram[i] * log2((double)histogram[i] / total);
+	}
+	return total ? bits / total : 0;
+}
+
+
+BlockPlan planBlock(const unsigned char* block, int length)
+{
+	// Sample 16 pieces of 4 KB spread through the block
+	const int pieceLength = 4096;
+	const int pieces = 16;
+	std::vector<unsigned char> sample;
+	if (length <= pieces * pieceLength)
+	{
+		sample.assign(block, block + length);
+	}
+	else
+	{
+		for (int piece = 0; piece < pieces; piece++)
+		{
+			const unsigned char* p = block + (long long)(length - pieceLength) * piece / (pieces - 1);
+			sample.insert(sample.end(), p, p + pieceLength);
+		}
+	}
+	int sampleLength = (int)sample.size();
+
+	BlockPlan plan;
+	int histogram[256] = {};
+	for (unsigned char byte : sample) histogram[byte]++;
+	double bytesEntropy = entropy(histogram, sampleLength);
+
+	// Unless the bytes are close to random, look for numbers whose differences at some distance vary less
+	// than the bytes themselves, and for calls and jumps with nearby targets
+	std::vector<int> candidates = { 0 };
+	if (bytesEntropy <= 7.9)
+	{
+		double bestEntropy = bytesEntropy - 0.5;
+		int bestDistance = 0;
+		for (int distance : { 1, 2, 3, 4, 8 })
+		{
+			int differences[256] = {};
+			for (int i = distance; i < sampleLength; i++) differences[(unsigned char)(sample[(size_t)i] - sample[(size_t)(i - distance)])]++;
+			double differencesEntropy = entropy(differences, sampleLength - distance);
+			if (differencesEntropy < bestEntropy)
+			{
+				bestEntropy = differencesEntropy;
+				bestDistance = distance;
+			}
+		}
+		if (bestDistance) candidates.push_back(FILTER_DELTA | (bestDistance << 8));
+
+		int calls = 0;
+		for (int i = 0; i + 5 <= sampleLength; i++)
+		{
+			if (((sample[(size_t)i] & 0xfe) == 0xe8) && ((sample[(size_t)i + 4] == 0) || (sample[(size_t)i + 4] == 0xff))) calls++;
+		}
+		if (calls * 256 > sampleLength) candidates.push_back(FILTER_X86);
+	}
+
+	// Compress 32 KB from the middle of the block with each filter and then with each dictionary length.
+	// The piece is taken whole rather than from the sample so that matches reach as far back as they would.
+	int trialLength = std::min(length, 8 * pieceLength);
+	const unsigned char* piece = block + (length - trialLength) / 2;
+	std::vector<unsigned char> trial((size_t)trialLength);
+	std::vector<unsigned char> compressed((size_t)StreamCompressor::bound(trialLength));
+	CompressOptions trialOptions;
+	trialOptions.level = LEVEL_DOUBLE_FAST;
+	auto trialSize = [&](int filter, int dictionaryLength)
+	{
+		memcpy(trial.data(), piece, trial.size());
+		applyFilter(trial.data(), trialLength, filter, true);
+		return compress(trial.data(), trialLength, compressed.data(), (int)compressed.size(), dictionaryLength, trialOptions);
+	};
+	int best = 0;
+	for (int filter : candidates)
+	{
+		int stored = trialSize(filter, plan.dictionaryLength);
+		if ((filter == 0) || (stored < best))
+		{
+			best = stored;
+			plan.filter = filter;
+		}
+	}
+	if (best > trialLength - trialLength / 50)
+	{
+		plan.store = true;
+		return plan;
+	}
+	for (int dictionaryLength : { 2048, 16384 })
+	{
+		int stored = trialSize(plan.filter, dictionaryLength);
+		if (stored < best)
+		{
+			best = stored;
+			plan.dictionaryLength = dictionaryLength;
+		}
+	}
+	return plan;
+}
+
+
+bool isValidStream(const unsigned char* stream, int storedLength, long long rawLength)
+{
+	// Check that a stream ends within storedLength bytes and decodes to rawLength bytes
+	return (getCompressedLength(stream, storedLength) >= 0) && (getDecompressedLength(stream) == rawLength);
+}
+
+
+bool decompressFiltered(const unsigned char* payload, int storedLength, unsigned char* output, int rawLength)
+{
+	// Decode a BLOCK_FILTERED payload, returning false if it is corrupt
+	int filter = 0;
+	if (storedLength >= (int)sizeof(int)) memcpy(&filter, payload, sizeof(int));
+	const unsigned char* stream = payload + sizeof(int);
+	if (!isValidFilter(filter) || !isValidStream(stream, storedLength - (int)sizeof(int), rawLength))
+	{
+		return false;
+	}
+	decompress(stream, output, rawLength);
+	applyFilter(output, rawLength, filter, false);
+	return true;
+}
+
+
+struct DecodeJob
+{
+	int type = BLOCK_END;
+	int storedLength = 0;
+	long long rawLength = 0;
+	std::vector<unsigned char> payload;
+	std::vector<unsigned char> output;
+};
+
+
+bool decodeBlock(DecodeJob& job, int threads = 1)
+{
+	// Decode the block read into job, returning false if it is corrupt. A stream is decoded by up to
+	// threads threads. Zero blocks in a frame can be much longer than a block, so readers that don't
+	// need them in memory deal with them before calling this.
+	if (job.type == BLOCK_RAW)
+	{
+		// The payload is the data, so it is exchanged with the output rather than copied
+		if (job.storedLength != job.rawLength)
+		{
+			return false;
+		}
+		job.output.swap(job.payload);
+		job.output.resize((size_t)job.rawLength);
+		return true;
+	}
+
+	job.output.resize((size_t)job.rawLength);
+	switch (job.type)
+	{
+		case BLOCK_LZSS:
+			if (!isValidStream(job.payload.data(), job.storedLength, job.rawLength))
+			{
+				return false;
+			}
+			decompressParallel(job.payload.data(), job.output.data(), (int)job.rawLength, threads);
+			return true;
+
+		case BLOCK_LANES:
+			if (!isValidLanes(job.payload.data(), job.storedLength, (int)job.rawLength))
+			{
+				return false;
+			}
+			decompressLanes(job.payload.data(), job.output.data(), (int)job.rawLength);
+			return true;
+
+		case BLOCK_FILTERED:
+			return decompressFiltered(job.payload.data(), job.storedLength, job.output.data(), (int)job.rawLength);
+
+		case BLOCK_ZERO:
+			memset(job.output.data(), 0, (size_t)job.rawLength);
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+
+void compressBlock(FrameWriter& writer, unsigned char* block, int length, unsigned char* compressed, int compressedLength,
+				   const Options& options, const CompressOptions& compressOptions, Stats& stats)
+{
+	// Add a block to the frame in whichever form is smallest. The block may be changed by a filter.
+	if (isZero(block, length))
+	{
+		writer.zeros(length);
+		return;
+	}
+
+	double time = now();
+	BlockPlan plan;
+	if (options.detect) plan = planBlock(block, length);
+	if (options.lanes > 1) plan.filter = 0;
+
+	int storedLength = 0;
+	BlockType type = (options.lanes > 1) ? BLOCK_LANES : (plan.filter ? BLOCK_FILTERED : BLOCK_LZSS);
+	if (plan.store) type = BLOCK_RAW;
+	if (type == BLOCK_LANES)
+	{
+		storedLength = compressLanes(block, length, compressed, compressedLength, options.lanes, plan.dictionaryLength, compressOptions);
+	}
+	else if (type == BLOCK_FILTERED)
+	{
+		applyFilter(block, length, plan.filter, true);
+		memcpy(compressed, &plan.filter, sizeof(int));
+		storedLength = compress(block, length, compressed + sizeof(int), compressedLength - (int)sizeof(int),
+								plan.dictionaryLength, compressOptions);
+		if (storedLength > 0) storedLength += (int)sizeof(int);
+		if ((storedLength <= 0) || (storedLength >= length)) applyFilter(block, length, plan.filter, false);
+	}
+	else if (type == BLOCK_LZSS)
+	{
+		storedLength = compress(block, length, compressed, compressedLength, plan.dictionaryLength, compressOptions);
+	}
+	stats.codeTime += now() - time;
+
+	time = now();
+	if ((storedLength > 0) && (storedLength < length))
+	{
+		writer.block(type, compressed, storedLength, length);
+	}
+	else
+	{
+		writer.block(BLOCK_RAW, block, length, length);
+	}
+	stats.writeTime += now() - time;
+}
+
+
+// With --resume the progress of a compression is recorded in a checkpoint file next to the output, so
+// that a job that is interrupted continues from its last checkpoint rather than from the start. The
+// file holds two copies of a CheckpointHeader, written alternately so that one is always intact,
+// followed by the index entries of the blocks written, which are only ever appended to. A checkpoint
+// is taken once the output up to it is durable, and when resuming the last block is decoded and
+// compared with the input before anything is written after it.
+const int CHECKPOINT_MAGIC = (int)0x89435A4C;		// "LZC\x89" when stored little endian
+const int CHECKPOINT_VERSION = 1;
+const long long CHECKPOINT_INTERVAL = 64 << 20;	// Input compressed between checkpoints
+
+struct CheckpointHeader
+{
+	int magic;
+	int version;
+	long long sequence;			// Number of the checkpoint, the later of the two copies is used
+	long long inputLength;		// Size and modification time of the input, which mustn't change
+	long long inputModified;
+	long long rangeStart;		// Range of the input being compressed
+	long long rangeEnd;
+	int level;					// Settings that change the output
+	int lanes;
+	int detect;
+	int blockLength;
+	long long blocks;			// Number of index entries following the headers
+	long long rawOffset;		// Length of the range compressed
+	long long outputOffset;		// Length of the output written
+	unsigned long long checksum;
+};
+
+
+class Checkpoint
+{
+public:
+	// Record checkpoints at path for the job described by the settings in job
+	Checkpoint(const string& path, const CheckpointHeader& job) : path(path), header(job)
+	{
+		header.magic = CHECKPOINT_MAGIC;
+		header.version = CHECKPOINT_VERSION;
+	}
+
+	~Checkpoint()
+	{
+		if (fd >= 0) close(fd);
+	}
+
+	// Read the last checkpoint of the same job, returning false if there is none
+	bool load(std::vector<IndexEntry>& index)
+	{
+		InputFile input(path, true);
+		CheckpointHeader copies[2] = {};
+		for (int copy = 0; copy < 2; copy++)
+		{
+			if (input.read(copy * (long long)sizeof(CheckpointHeader), &copies[copy], sizeof(CheckpointHeader)) &&
+				isValid(copies[copy]) && (copies[copy].sequence > header.sequence))
+			{
+				header = copies[copy];
+			}
+		}
+		if (header.sequence == 0)
+		{
+			return false;
+		}
+		index.resize((size_t)header.blocks);
+		if (!input.read(2 * (long long)sizeof(CheckpointHeader), index.data(), header.blocks * (long long)sizeof(IndexEntry)))
+		{
+			header.sequence = 0;
+			return false;
+		}
+		saved = header.blocks;
+		return true;
+	}
+
+	long long rawOffset() const
+	{
+		return header.rawOffset;
+	}
+
+	long long outputOffset() const
+	{
+		return header.outputOffset;
+	}
+
+	// Record that the output is durable up to outputOffset, holding the blocks in index
+	void save(const std::vector<IndexEntry>& index, long long rawOffset, long long outputOffset)
+	{
+		if (fd < 0)
+		{
+			// A checkpoint that wasn't loaded belongs to an earlier job and is replaced
+			fd = open(path.c_str(), O_RDWR | O_CREAT | ((header.sequence == 0) ? O_TRUNC : 0), 0644);
+			if (fd < 0) error("Unable to open checkpoint file " + path);
+		}
+
+		// Append the new index entries and make them durable before the header that counts them
+		long long entries = (long long)index.size();
+		if (!writeAt(fd, (const char*)(index.data() + saved), (entries - saved) * (long long)sizeof(IndexEntry),
+					 2 * (long long)sizeof(CheckpointHeader) + saved * (long long)sizeof(IndexEntry)) ||
+			(fdatasync(fd) != 0))
+		{
+			error("Unable to write checkpoint file " + path);
+		}
+		saved = entries;
+
+		header.sequence++;
+		header.blocks = entries;
+		header.rawOffset = rawOffset;
+		header.outputOffset = outputOffset;
+		header.checksum = checksum(header);
+		if (!writeAt(fd, (const char*)&header, sizeof(header), (header.sequence % 2) * (long long)sizeof(header)) ||
+			(fdatasync(fd) != 0))
+		{
+			error("Unable to write checkpoint file " + path);
+		}
+	}
+
+	// Delete the checkpoint once the job is complete
+	void remove()
+	{
+		if (fd >= 0) close(fd);
+		fd = -1;
+		unlink(path.c_str());
+	}
+
+private:
+	static unsigned long long checksum(const CheckpointHeader& copy)
+	{
+		// FNV-1a of everything before the checksum
+		unsigned long long hash = 14695981039346656037ull;
+		auto bytes = (const unsigned char*)&copy;
+		for (size_t i = 0; i < offsetof(CheckpointHeader, checksum); i++)
+		{
+			hash = (hash ^ bytes[i]) * 1099511628211ull;
+		}
+		return hash;
+	}
+
+	bool isValid(const CheckpointHeader& copy) const
+	{
+		return (copy.magic == CHECKPOINT_MAGIC) && (copy.version == CHECKPOINT_VERSION) && (copy.checksum == checksum(copy)) &&
+			   (copy.inputLength == header.inputLength) && (copy.inputModified == header.inputModified) &&
+			   (copy.rangeStart == header.rangeStart) && (copy.rangeEnd == header.rangeEnd) && (copy.level == header.level) &&
+			   (copy.lanes == header.lanes) && (copy.detect == header.detect) && (copy.blockLength == header.blockLength) &&
+			   (copy.blocks >= 0) && (copy.rawOffset >= 0) && (copy.rawOffset <= copy.rangeEnd - copy.rangeStart);
+	}
+
+	string path;
+	CheckpointHeader header;
+	int fd = -1;
+	long long saved = 0;			// Index entries in the file
+};
+
+
+bool verifyTail(const string& output_file, const InputFile& input, long long rangeStart, const std::vector<IndexEntry>& index,
+				long long rawOffset, long long outputOffset)
+{
+	// Check that the output holds a frame up to the checkpoint and that its last block decodes to the input
+	InputFile output(output_file, true);
+	FrameHeader frame = {};
+	if ((output.size() < outputOffset) || !output.read(0, &frame, sizeof(frame)) || (frame.magic != FRAME_MAGIC) ||
+		(frame.blockLength <= 0) || (frame.blockLength > (1 << 30)))
+	{
+		return false;
+	}
+	if (index.empty())
+	{
+		return (rawOffset == 0) && (outputOffset <= (long long)(sizeof(frame) + sizeof(BlockHeader)));
+	}
+
+	const IndexEntry& last = index.back();
+	BlockHeader header = {};
+	if (!output.read(last.frameOffset, &header, sizeof(header)) || (header.storedLength < 0) ||
+		(header.storedLength > frame.blockLength + 64) || (header.rawLength < 0) ||
+		((header.type != BLOCK_ZERO) && (header.rawLength > frame.blockLength)) ||
+		(last.frameOffset + (long long)sizeof(header) + header.storedLength != outputOffset) ||
+		(last.rawOffset + header.rawLength != rawOffset))
+	{
+		return false;
+	}
+
+	// A run of zeros is compared a block at a time, skipping any holes in the input
+	std::vector<unsigned char> data((size_t)std::min(header.rawLength, (long long)frame.blockLength));
+	if (header.type == BLOCK_ZERO)
+	{
+		long long offset = rangeStart + last.rawOffset;
+		long long end = offset + header.rawLength;
+		while ((offset = input.nextData(offset)) < end)
+		{
+			int length = (int)std::min(end - offset, (long long)data.size());
+			if (!input.read(offset, data.data(), length) || !isZero(data.data(), length)) return false;
+			offset += length;
+		}
+		return true;
+	}
+
+	DecodeJob job;
+	job.type = header.type;
+	job.storedLength = header.storedLength;
+	job.rawLength = header.rawLength;
+	job.payload.resize((size_t)header.storedLength + 8);
+	return output.read(last.frameOffset + (long long)sizeof(header), job.payload.data(), header.storedLength) &&
+		   decodeBlock(job) && input.read(rangeStart + last.rawOffset, data.data(), header.rawLength) &&
+		   (memcmp(job.output.data(), data.data(), (size_t)header.rawLength) == 0);
+}
+
+
+void compressFile(const string& input_file, const string& output_file, const Options& options, Stats& stats)
+{
+	InputFile input(input_file);
+
+	// Compress the whole file unless a range of it was asked for
+	long long rangeStart = options.rangeOffset;
+	long long rangeEnd = input.size();
+	if (rangeStart > rangeEnd)
+	{
+		error("Range starts beyond the end of " + input_file);
+	}
+	if ((options.rangeLength >= 0) && (rangeStart + options.rangeLength < rangeEnd))
+	{
+		rangeEnd = rangeStart + options.rangeLength;
+	}
+	stats.inputBytes = rangeEnd - rangeStart;
+
+	FILE* trace = nullptr;
+	if (!options.trace.empty())
+	{
+		trace = fopen(options.trace.c_str(), "w");
+		if (!trace) error("Unable to open trace file " + options.trace);
+	}
+
+	CompressOptions compressOptions;
+	compressOptions.level = options.level;
+	compressOptions.prefetchDistance = options.prefetchDistance;
+	compressOptions.threads = options.threads;
+	compressOptions.trace = trace;
+
+	// A legacy stream can't be split at checkpoints, and direct output holds back data it can't sync
+	if (options.resume && (options.legacy || options.direct))
+	{
+		error("--resume can't be used with --legacy or --direct");
+	}
+
+	const int dictionaryLength = 8192;
+	if (options.legacy)
+	{
+		OutputFile output(output_file, options.direct);
+		compressLegacy(input, output, rangeStart, rangeEnd, dictionaryLength, compressOptions, stats);
+		if (trace) fclose(trace);
+		return;
+	}
+
+	// Continue from the last checkpoint of the same job if its output is intact
+	const int blockLength = 1 << 20;
+	std::unique_ptr<Checkpoint> checkpoint;
+	std::vector<IndexEntry> index;
+	bool resumed = false;
+	if (options.resume)
+	{
+		struct stat status = {};
+		stat(input_file.c_str(), &status);
+		CheckpointHeader job = {};
+		job.inputLength = input.size();
+		job.inputModified = (long long)status.st_mtim.tv_sec * 1000000000 + status.st_mtim.tv_nsec;
+		job.rangeStart = rangeStart;
+		job.rangeEnd = rangeEnd;
+		job.level = options.level;
+		job.lanes = options.lanes;
+		job.detect = options.detect;
+		job.blockLength = blockLength;
+		checkpoint.reset(new Checkpoint(output_file + ".ckpt", job));
+		resumed = checkpoint->load(index) &&
+				  verifyTail(output_file, input, rangeStart, index, checkpoint->rawOffset(), checkpoint->outputOffset());
+		if (resumed)
+		{
+			cout << "Resuming at offset " << rangeStart + checkpoint->rawOffset() << endl;
+		}
+		else
+		{
+			index.clear();
+			checkpoint.reset(new Checkpoint(output_file + ".ckpt", job));
+		}
+	}
+
+	OutputFile output(output_file, options.direct, resumed ? checkpoint->outputOffset() : -1);
+	FrameWriter writer = resumed ? FrameWriter(output, index, checkpoint->outputOffset(), checkpoint->rawOffset())
+								 : FrameWriter(output, dictionaryLength, blockLength);
+	if ((options.rangeLength >= 0) && !resumed)
+	{
+		writer.segment(rangeStart);
+	}
+
+	// A block that doesn't compress is stored raw, so the output buffer only needs room for a raw block
+	int compressedLength = blockLength + 64;
+	auto block = new unsigned char[blockLength];
+	auto compressed = new unsigned char[compressedLength];
+
+	long long offset = rangeStart + writer.rawSize();
+	long long checkpointed = offset;
+	while (offset < rangeEnd)
+	{
+		// Skip over any hole in the input
+		long long data = input.nextData(offset);
+		if (data > rangeEnd) data = rangeEnd;
+		writer.zeros(data - offset);
+		offset = data;
+
+		// Compress the data up to the next hole a block at a time
+		long long hole = input.nextHole(offset);
+		if (hole > rangeEnd) hole = rangeEnd;
+		while (offset < hole)
+		{
+			int length = (int)((hole - offset) < blockLength ? (hole - offset) : blockLength);
+			double time = now();
+			if (!input.read(offset, block, length))
+			{
+				error("Input file " + input_file + " changed while compressing");
+			}
+			stats.readTime += now() - time;
+			offset += length;
+
+			compressBlock(writer, block, length, compressed, compressedLength, options, compressOptions, stats);
+
+			if (checkpoint && (offset - checkpointed >= CHECKPOINT_INTERVAL))
+			{
+				time = now();
+				const std::vector<IndexEntry>& blocks = writer.blocks();
+				output.sync();
+				checkpoint->save(blocks, writer.rawSize(), writer.size());
+				checkpointed = offset;
+				stats.writeTime += now() - time;
+			}
+		}
+	}
+
+	// Terminate the frame, writing out any trailing run of zeros first
+	double time = now();
+	writer.finish();
+	if (checkpoint)
+	{
+		output.sync();
+		checkpoint->remove();
+	}
+	stats.writeTime += now() - time;
+	stats.outputBytes = writer.size();
+
+	if (trace) fclose(trace);
+	delete[] block;
+	delete[] compressed;
+}
+
+
+class FrameScanner
+{
+public:
+	// Reads the blocks of a file that may hold any number of concatenated frames and legacy compress()
+	// streams, one after the other, so that files compressed separately can be joined with cat. A legacy
+	// stream is returned as a single BLOCK_LZSS block.
+	FrameScanner(const InputFile& input, const string& path) : input(input), path(path)
+	{
+	}
+
+	// Offset of the range held by the last frame read if it is a segment of a larger file, otherwise -1
+	long long segment() const
+	{
+		return segmentOffset;
+	}
+
+	// Return true if a legacy stream has been read
+	bool sawLegacyStream() const
+	{
+		return legacy;
+	}
+
+	// Return the largest block length of the frames read
+	int maxBlockLength() const
+	{
+		return blockLength;
+	}
+
+	// Read the next block into job, returning false at the end of the file
+	bool next(DecodeJob& job)
+	{
+		while (true)
+		{
+			if (!inFrame)
+			{
+				if (offset == input.size())
+				{
+					return false;
+				}
+
+				int magic = 0;
+				if (!input.read(offset, &magic, sizeof(magic)))
+				{
+					error("Unexpected end of input file " + path);
+				}
+				if (magic != FRAME_MAGIC)
+				{
+					readLegacyStream(job);
+					return true;
+				}
+
+				if (!input.read(offset, &frame, sizeof(frame)))
+				{
+					error("Unexpected end of input file " + path);
+				}
+				if (frame.version != FRAME_VERSION)
+				{
+					error("Unsupported frame version in " + path);
+				}
+				if ((frame.blockLength <= 0) || (frame.blockLength > (1 << 30)))
+				{
+					error("Corrupt frame header in " + path);
+				}
+				offset += sizeof(frame);
+				inFrame = true;
+				segmentOffset = -1;
+				if (frame.blockLength > blockLength) blockLength = frame.blockLength;
+			}
+
+			BlockHeader header = {};
+			if (!input.read(offset, &header, sizeof(header)))
+			{
+				error("Unexpected end of input file " + path);
+			}
+			offset += sizeof(header);
+			if (header.type == BLOCK_END)
+			{
+				inFrame = false;
+				continue;
+			}
+			if (header.type == BLOCK_SEGMENT)
+			{
+				segmentOffset = header.rawLength;
+				continue;
+			}
+			if (((header.type == BLOCK_INDEX) || (header.type == BLOCK_MEMBERS)) && (header.storedLength >= 0))
+			{
+				offset += header.storedLength;
+				continue;
+			}
+			if ((header.storedLength < 0) || (header.storedLength > frame.blockLength + 64) ||
+				(header.rawLength < 0) || ((header.type != BLOCK_ZERO) && (header.rawLength > frame.blockLength)))
+			{
+				error("Corrupt block header in " + path);
+			}
+
+			job.type = header.type;
+			job.storedLength = header.storedLength;
+			job.rawLength = header.rawLength;
+			readPayload(job, header.storedLength);
+			return true;
+		}
+	}
+
+private:
+	void readPayload(DecodeJob& job, long long length)
+	{
+		// The payload is followed by a few zero bytes so that a corrupt stream can't read beyond it
+		job.payload.resize((size_t)length + 8);
+		memset(job.payload.data() + length, 0, 8);
+		if (!input.read(offset, job.payload.data(), length))
+		{
+			error("Unexpected end of input file " + path);
+		}
+		offset += length;
+	}
+
+	void readLegacyStream(DecodeJob& job)
+	{
+		// The length of a legacy stream isn't stored, but each literal costs at most 9 bits so it can't be
+		// longer than the uncompressed data plus an eighth. Read that much and then find where it ends.
+		int header[2] = {};
+		if (!input.read(offset, header, sizeof(header)) || (header[0] < 0))
+		{
+			error("Unrecognised data in " + path);
+		}
+		long long available = input.size() - offset;
+		long long bound = (long long)sizeof(header) + header[0] + header[0] / 8 + 16;
+		long long start = offset;
+		readPayload(job, bound < available ? bound : available);
+		int length = getCompressedLength(job.payload.data(), (int)(offset - start));
+		if (length < 0)
+		{
+			error("Corrupt or truncated stream in " + path);
+		}
+		offset = start + length;
+		job.type = BLOCK_LZSS;
+		job.storedLength = length;
+		job.rawLength = header[0];
+		legacy = true;
+	}
+
+	const InputFile& input;
+	string path;
+	long long offset = 0;
+	bool inFrame = false;
+	bool legacy = false;
+	FrameHeader frame = {};
+	long long segmentOffset = -1;
+	int blockLength = 0;
+};
+
+
+class FrameReader
+{
+public:
+	// Reads a compressed file as a sequence of decoded blocks. A background thread decodes up to depth
+	// blocks ahead of the consumer into a pool of depth + 1 buffers, which are reused as the consumer
+	// moves on, so a consumer that reads sequentially rarely waits for a block to be decoded.
+	FrameReader(const string& path, int depth = 2) : path(path), input(path), scanner(input, path), buffers((size_t)depth + 1)
+	{
+		if (depth < 1)
+		{
+			error("Read ahead depth must be at least 1");
+		}
+		for (int buffer = 0; buffer <= depth; buffer++)
+		{
+			free.push_back(buffer);
+		}
+		worker = std::thread([this]() { decodeAhead(); });
+	}
+
+	~FrameReader()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		bufferFree.notify_all();
+		worker.join();
+	}
+
+	// Get the next block of decoded data, returning false at the end of the file. The data is null for a
+	// run of zeros, and remains valid until the following call.
+	bool next(const unsigned char*& data, long long& length)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if (current >= 0)
+		{
+			free.push_back(current);
+			current = -1;
+			bufferFree.notify_one();
+		}
+		blockReady.wait(lock, [this]() { return !ready.empty(); });
+		Block block = ready.front();
+		if (block.buffer < 0)
+		{
+			return false;
+		}
+		ready.pop_front();
+		current = block.buffer;
+		data = block.zero ? nullptr : buffers[(size_t)block.buffer].data();
+		length = block.length;
+		return true;
+	}
+
+private:
+	struct Block
+	{
+		int buffer;				// Buffer holding the data, or -1 at the end of the file
+		long long length;
+		bool zero;				// The block is a run of zeros and its buffer holds nothing
+	};
+
+	void decodeAhead()
+	{
+		DecodeJob job;
+		while (scanner.next(job))
+		{
+			int buffer;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				bufferFree.wait(lock, [this]() { return stopping || !free.empty(); });
+				if (stopping) return;
+				buffer = free.back();
+				free.pop_back();
+			}
+
+			// The decoded block is exchanged with the buffer, whose old contents are reused for the next one
+			if (job.type != BLOCK_ZERO)
+			{
+				if (!decodeBlock(job))
+				{
+					error("Corrupt block in " + path);
+				}
+				job.output.swap(buffers[(size_t)buffer]);
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				ready.push_back({ buffer, job.rawLength, job.type == BLOCK_ZERO });
+			}
+			blockReady.notify_one();
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			ready.push_back({ -1, 0, false });
+		}
+		blockReady.notify_one();
+	}
+
+	string path;
+	InputFile input;
+	FrameScanner scanner;
+	std::vector<std::vector<unsigned char>> buffers;
+	std::mutex mutex;
+	std::condition_variable bufferFree;
+	std::condition_variable blockReady;
+	std::vector<int> free;			// Buffers that can be decoded into
+	std::deque<Block> ready;		// Decoded blocks waiting for the consumer
+	int current = -1;				// Buffer of the block last returned to the consumer
+	bool stopping = false;
+	std::thread worker;
+};
+
+
+void decompressFile(const string& input_file, const string& output_file, const Options& options, Stats& stats)
+{
+	InputFile input(input_file);
+	OutputFile output(output_file, options.direct);
+	FrameScanner scanner(input, input_file);
+	stats.inputBytes = input.size();
+
+	// With read ahead the blocks are decoded on a background thread while this one writes them out, and
+	// the time spent waiting for the next block counts as decompression
+	if (options.readAhead > 0)
+	{
+		FrameReader reader(input_file, options.readAhead);
+		const unsigned char* data;
+		long long length;
+		double time = now();
+		while (reader.next(data, length))
+		{
+			stats.codeTime += now() - time;
+			time = now();
+			if (data)
+			{
+				output.write(data, length);
+			}
+			else
+			{
+				output.skip(length);
+			}
+			stats.outputBytes += length;
+			stats.writeTime += now() - time;
+			time = now();
+		}
+		output.finish();
+		return;
+	}
+
+	// Blocks are read a batch at a time, one for each thread, decoded in parallel and written in order
+	std::vector<DecodeJob> jobs((size_t)options.threads);
+	while (true)
+	{
+		double time = now();
+		int count = 0;
+		while ((count < options.threads) && scanner.next(jobs[count]))
+		{
+			count++;
+		}
+		stats.readTime += now() - time;
+		if (count == 0)
+		{
+			break;
+		}
+
+		// Threads left over when there are fewer blocks than threads, as with a single legacy stream, go
+		// towards decoding each block
+		time = now();
+		int blockThreads = options.threads / count;
+		parallelFor(count, options.threads, [&](int index)
+		{
+			DecodeJob& job = jobs[index];
+			if ((job.type != BLOCK_ZERO) && !decodeBlock(job, blockThreads))
+			{
+				error("Corrupt block in " + input_file);
+			}
+		});
+		stats.codeTime += now() - time;
+
+		time = now();
+		for (int index = 0; index < count; index++)
+		{
+			DecodeJob& job = jobs[index];
+			if (job.type == BLOCK_ZERO)
+			{
+				output.skip(job.rawLength);
+			}
+			else
+			{
+				output.write(job.output.data(), job.rawLength);
+			}
+			stats.outputBytes += job.rawLength;
+		}
+		stats.writeTime += now() - time;
+	}
+	output.finish();
+}
+
+
+void mergeFiles(const string& output_file, const std::vector<string>& segment_files)
+{
+	// Find the range of the file held by each segment from its first block and its trailer
+	struct Segment
+	{
+		string path;
+		long long offset;
+		long long length;
+	};
+	std::vector<Segment> segments;
+	FrameHeader merged = { FRAME_MAGIC, FRAME_VERSION, 0, 0 };
+	for (auto& path : segment_files)
+	{
+		InputFile input(path);
+		FrameHeader frame = {};
+		BlockHeader first = {};
+		BlockHeader end = {};
+		if (!input.read(0, &frame, sizeof(frame)) || (frame.magic != FRAME_MAGIC) ||
+			!input.read(sizeof(frame), &first, sizeof(first)) ||
+			!input.read(input.size() - (long long)sizeof(end), &end, sizeof(end)) ||
+			(end.type != BLOCK_END) || (end.storedLength <= 0))
+		{
+			error("Input file " + path + " is not a compressed segment");
+		}
+		segments.push_back({ path, first.type == BLOCK_SEGMENT ? first.rawLength : 0, end.rawLength });
+		if (frame.dictionaryLength > merged.dictionaryLength) merged.dictionaryLength = frame.dictionaryLength;
+		if (frame.blockLength > merged.blockLength) merged.blockLength = frame.blockLength;
+	}
+
+	// The segments must cover a single range without gaps or overlaps
+	std::sort(segments.begin(), segments.end(), [](const Segment& a, const Segment& b) { return a.offset < b.offset; });
+	for (size_t i = 1; i < segments.size(); i++)
+	{
+		if (segments[i].offset != segments[i - 1].offset + segments[i - 1].length)
+		{
+			error("Segments " + segments[i - 1].path + " and " + segments[i].path + " are not contiguous");
+		}
+	}
+
+	// Copy the blocks of each segment into a single frame with a new index. The result is itself a
+	// segment unless it starts at the beginning of the file, so merges can be done in stages.
+	OutputFile output(output_file);
+	FrameWriter writer(output, merged.dictionaryLength, merged.blockLength);
+	if (segments.front().offset)
+	{
+		writer.segment(segments.front().offset);
+	}
+	DecodeJob job;
+	for (auto& segment : segments)
+	{
+		InputFile input(segment.path);
+		FrameScanner scanner(input, segment.path);
+		while (scanner.next(job))
+		{
+			writer.block(job.type, job.payload.data(), job.storedLength, job.rawLength);
+		}
+	}
+	writer.finish();
+}
+
+
+// An archive stores many files in one frame. The files are sorted so that similar ones are adjacent and
+// concatenated, so a block holds many small files and matches reach from one into the next, and a file
+// that fits in a block is never split between two. The member table in the trailer maps each file to
+// the block it starts in, its offset there and its length, so a single file is extracted by decoding
+// only the blocks that hold it while the archive as a whole decompresses to the concatenated files.
+struct ArchiveMember
+{
+	long long length;			// Length of the file
+	int block;					// Index of the block holding the start of the file
+	int offset;					// Offset of the file in the decoded block
+	int mode;					// Permissions of the file
+	int nameLength;				// Length of the name that follows
+};
+
+
+struct ArchiveEntry
+{
+	string name;
+	ArchiveMember member;
+};
+
+
+void findArchiveFiles(const string& path, std::vector<ArchiveEntry>& entries)
+{
+	// Add path, or the regular files below it if it is a directory
+	struct stat status = {};
+	if (lstat(path.c_str(), &status) != 0)
+	{
+		error("Unable to open input file " + path);
+	}
+	if (S_ISDIR(status.st_mode))
+	{
+		DIR* directory = opendir(path.c_str());
+		if (!directory)
+		{
+			error("Unable to open directory " + path);
+		}
+		while (dirent* entry = readdir(directory))
+		{
+			string name(entry->d_name);
+			if ((name != ".") && (name != ".."))
+			{
+				findArchiveFiles((path.back() == '/') ? path + name : path + "/" + name, entries);
+			}
+		}
+		closedir(directory);
+	}
+	else if (S_ISREG(status.st_mode))
+	{
+		ArchiveEntry entry = {};
+		entry.name = path;
+		entry.member.length = (long long)status.st_size;
+		entry.member.mode = (int)(status.st_mode & 07777);
+		entries.push_back(entry);
+	}
+}
+
+
+string archiveName(const string& path)
+{
+	// Names are stored relative so that extraction stays below the current directory, dropping the
+	// leading / and any . components of the path and resolving each .. against the component before it
+	std::vector<string> components;
+	size_t start = 0;
+	while (start <= path.size())
+	{
+		size_t end = path.find('/', start);
+		if (end == string::npos) end = path.size();
+		string component = path.substr(start, end - start);
+		if (component == "..")
+		{
+			if (components.empty())
+			{
+				error("Unable to archive " + path + " from outside the current directory");
+			}
+			components.pop_back();
+		}
+		else if (!component.empty() && (component != "."))
+		{
+			components.push_back(component);
+		}
+		start = end + 1;
+	}
+	string name;
+	for (const string& component : components)
+	{
+		name += (name.empty() ? "" : "/") + component;
+	}
+	return name;
+}
+
+
+string archiveSortKey(const string& name)
+{
+	// Files are ordered by extension, then by file name, then by directory
+	size_t slash = name.rfind('/');
+	string file = (slash == string::npos) ? name : name.substr(slash + 1);
+	size_t dot = file.rfind('.');
+	string extension = ((dot == string::npos) || (dot == 0)) ? string() : file.substr(dot + 1);
+	return extension + '\0' + file + '\0' + name;
+}
+
+
+class ArchiveReader
+{
+public:
+	// Read the index and member table from the trailer of the archive at path
+	explicit ArchiveReader(const string& path) : path(path), input(path)
+	{
+		BlockHeader end = {};
+		if (!input.read(0, &frame, sizeof(frame)) || (frame.magic != FRAME_MAGIC) || (frame.version != FRAME_VERSION) ||
+			(frame.blockLength <= 0) || (frame.blockLength > (1 << 30)) ||
+			!input.read(input.size() - (long long)sizeof(end), &end, sizeof(end)) || (end.type != BLOCK_END) ||
+			(end.storedLength <= 0) || (end.storedLength > input.size() - (long long)(sizeof(frame) + sizeof(end))))
+		{
+			error("Input file " + path + " is not an archive");
+		}
+
+		bool found = false;
+		long long offset = input.size() - (long long)sizeof(end) - end.storedLength;
+		while (offset < input.size() - (long long)sizeof(end))
+		{
+			BlockHeader header = {};
+			std::vector<unsigned char> payload;
+			if (!input.read(offset, &header, sizeof(header)) || (header.storedLength < 0) ||
+				(offset + (long long)sizeof(header) + header.storedLength > input.size() - (long long)sizeof(end)))
+			{
+				error("Corrupt trailer in " + path);
+			}
+			payload.resize((size_t)header.storedLength + 8);
+			input.read(offset + (long long)sizeof(header), payload.data(), header.storedLength);
+			offset += (long long)sizeof(header) + header.storedLength;
+
+			if (header.type == BLOCK_INDEX)
+			{
+				index.resize((size_t)header.storedLength / sizeof(IndexEntry));
+				memcpy(index.data(), payload.data(), index.size() * sizeof(IndexEntry));
+			}
+			else if (header.type == BLOCK_MEMBERS)
+			{
+				readMembers(payload, header.storedLength, header.rawLength);
+				found = true;
+			}
+		}
+		if (!found)
+		{
+			error("Input file " + path + " is not an archive");
+		}
+	}
+
+	const std::vector<ArchiveEntry>& entries() const
+	{
+		return members;
+	}
+
+	// Write the data of a member to output, decoding only the blocks that hold it
+	void extract(const ArchiveEntry& entry, OutputFile& output)
+	{
+		long long remaining = entry.member.length;
+		int block = entry.member.block;
+		long long offset = entry.member.offset;
+		while (remaining > 0)
+		{
+			const DecodeJob& job = decode(block);
+			if (offset > job.rawLength)
+			{
+				error("Corrupt member table in " + path);
+			}
+			long long length = std::min(remaining, job.rawLength - offset);
+			output.write(job.output.data() + offset, length);
+			remaining -= length;
+			offset = 0;
+			block++;
+		}
+	}
+
+private:
+	void readMembers(const std::vector<unsigned char>& payload, int storedLength, long long rawLength)
+	{
+		// Each string of at most maxMatch bytes takes 17 bits, which bounds the length of the table
+		if ((rawLength < 0) || (rawLength > INT32_MAX) || (getCompressedLength(payload.data(), storedLength) < 0) ||
+			(getDecompressedLength(payload.data()) != rawLength) ||
+			(rawLength > ((long long)storedLength * 8 / 17 + 1) * ((65536 / ((const int*)payload.data())[1]) + 2)))
+		{
+			error("Corrupt member table in " + path);
+		}
+		std::vector<unsigned char> table((size_t)rawLength);
+		decompress(payload.data(), table.data(), (int)rawLength);
+
+		size_t position = 0;
+		while (position < table.size())
+		{
+			ArchiveEntry entry = {};
+			if (table.size() - position < sizeof(entry.member))
+			{
+				error("Corrupt member table in " + path);
+			}
+			memcpy(&entry.member, table.data() + position, sizeof(entry.member));
+			position += sizeof(entry.member);
+			if ((entry.member.nameLength <= 0) || ((size_t)entry.member.nameLength > table.size() - position) ||
+				(entry.member.length < 0) || (entry.member.block < 0) || (entry.member.offset < 0))
+			{
+				error("Corrupt member table in " + path);
+			}
+			entry.name.assign((const char*)table.data() + position, (size_t)entry.member.nameLength);
+			position += (size_t)entry.member.nameLength;
+			members.push_back(entry);
+		}
+	}
+
+	const DecodeJob& decode(int block)
+	{
+		// The last block decoded is kept, as members extracted in order often share it
+		if (block == decoded)
+		{
+			return job;
+		}
+		BlockHeader header = {};
+		if ((block >= (int)index.size()) || !input.read(index[(size_t)block].frameOffset, &header, sizeof(header)) ||
+			(header.storedLength < 0) || (header.storedLength > frame.blockLength + 64) || (header.rawLength < 0) ||
+			(header.rawLength > frame.blockLength))
+		{
+			error("Corrupt block header in " + path);
+		}
+		job.type = header.type;
+		job.storedLength = header.storedLength;
+		job.rawLength = header.rawLength;
+		job.payload.resize((size_t)header.storedLength + 8);
+		memset(job.payload.data() + header.storedLength, 0, 8);
+		if (!input.read(index[(size_t)block].frameOffset + (long long)sizeof(header), job.payload.data(), header.storedLength) ||
+			!decodeBlock(job))
+		{
+			error("Corrupt block in " + path);
+		}
+		decoded = block;
+		return job;
+	}
+
+	string path;
+	InputFile input;
+	FrameHeader frame = {};
+	std::vector<IndexEntry> index;
+	std::vector<ArchiveEntry> members;
+	DecodeJob job;
+	int decoded = -1;			// Index of the block held in job
+};
+
+
+void createArchive(const string& archive_file, const std::vector<string>& arguments)
+{
+	// Gather the files named by the arguments and the files in the directories they name
+	Options options;
+	std::vector<ArchiveEntry> entries;
+	for (size_t i = 0; i < arguments.size(); i++)
+	{
+		if ((arguments[i] == "--level") && (i + 1 < arguments.size()))
+		{
+			options.level = atoi(arguments[++i].c_str());
+		}
+		else if (arguments[i] == "--no-detect")
+		{
+			options.detect = false;
+		}
+		else
+		{
+			findArchiveFiles(arguments[i], entries);
+		}
+	}
+	std::stable_sort(entries.begin(), entries.end(), [](const ArchiveEntry& a, const ArchiveEntry& b)
+	{
+		return archiveSortKey(a.name) < archiveSortKey(b.name);
+	});
+	std::vector<string> names;
+	std::set<string> seen;
+	for (const ArchiveEntry& entry : entries)
+	{
+		names.push_back(archiveName(entry.name));
+		if (!seen.insert(names.back()).second)
+		{
+			error("More than one file would be archived as " + names.back());
+		}
+	}
+	cout << "Archiving " << entries.size() << " files into " << archive_file << endl;
+
+	CompressOptions compressOptions;
+	compressOptions.level = options.level;
+	const int dictionaryLength = 8192;
+	const int blockLength = 1 << 20;
+	int compressedLength = blockLength + 64;
+	std::vector<unsigned char> block((size_t)blockLength);
+	std::vector<unsigned char> compressed((size_t)compressedLength);
+	OutputFile output(archive_file);
+	FrameWriter writer(output, dictionaryLength, blockLength);
+	Stats stats;
+
+	// Each block is written as it is filled. Pending zeros are written straight away rather than merged
+	// with the next block, so no block of an archive is longer than blockLength.
+	auto addBlock = [&](int length)
+	{
+		compressBlock(writer, block.data(), length, compressed.data(), compressedLength, options, compressOptions, stats);
+		writer.blocks();
+	};
+
+	// Fill each block with files, starting a new one rather than splitting a file that would fit in it
+	std::vector<long long> offsets;
+	long long rawOffset = 0;
+	int fill = 0;
+	for (auto& entry : entries)
+	{
+		if ((fill > 0) && (fill + entry.member.length > blockLength) && (entry.member.length <= blockLength))
+		{
+			addBlock(fill);
+			fill = 0;
+		}
+		offsets.push_back(rawOffset);
+
+		InputFile input(entry.name);
+		long long position = 0;
+		while (position < entry.member.length)
+		{
+			int length = (int)std::min(entry.member.length - position, (long long)(blockLength - fill));
+			if (!input.read(position, block.data() + fill, length))
+			{
+				error("Input file " + entry.name + " changed while archiving");
+			}
+			position += length;
+			fill += length;
+			rawOffset += length;
+			if (fill == blockLength)
+			{
+				addBlock(fill);
+				fill = 0;
+			}
+		}
+	}
+	if (fill > 0)
+	{
+		addBlock(fill);
+	}
+
+	// Locate each file in the blocks written
+	const std::vector<IndexEntry>& index = writer.blocks();
+	std::vector<unsigned char> table;
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		ArchiveMember& member = entries[i].member;
+		auto next = std::upper_bound(index.begin(), index.end(), offsets[i],
+									 [](long long offset, const IndexEntry& entry) { return offset < entry.rawOffset; });
+		member.block = (next == index.begin()) ? 0 : (int)(next - index.begin() - 1);
+		member.offset = (next == index.begin()) ? 0 : (int)(offsets[i] - index[(size_t)member.block].rawOffset);
+		const string& name = names[i];
+		member.nameLength = (int)name.size();
+		table.insert(table.end(), (const unsigned char*)&member, (const unsigned char*)(&member + 1));
+		table.insert(table.end(), name.begin(), name.end());
+	}
+	if (table.size() > INT32_MAX / 2)
+	{
+		error("Too many files to archive");
+	}
+
+	std::vector<unsigned char> stream((size_t)StreamCompressor::bound((int)table.size()));
+	int storedLength = compress(table.data(), (int)table.size(), stream.data(), (int)stream.size(), dictionaryLength, compressOptions);
+	writer.metadata(BLOCK_MEMBERS, stream.data(), storedLength, (long long)table.size());
+	writer.finish();
+}
+
+
+void makeParentDirectories(const string& path)
+{
+	for (size_t slash = path.find('/'); slash != string::npos; slash = path.find('/', slash + 1))
+	{
+		if ((slash > 0) && (mkdir(path.substr(0, slash).c_str(), 0777) != 0) && (errno != EEXIST))
+		{
+			error("Unable to create directory " + path.substr(0, slash));
+		}
+	}
+}
+
+
+void extractArchive(const string& archive_file, const std::vector<string>& names)
+{
+	// Extract the named members, or all of them, below the current directory
+	ArchiveReader reader(archive_file);
+	for (auto& name : names)
+	{
+		if (std::none_of(reader.entries().begin(), reader.entries().end(), [&](const ArchiveEntry& entry) { return entry.name == name; }))
+		{
+			error(name + " is not in " + archive_file);
+		}
+	}
+	for (auto& entry : reader.entries())
+	{
+		if (!names.empty() && (std::find(names.begin(), names.end(), entry.name) == names.end()))
+		{
+			continue;
+		}
+		if ((entry.name[0] == '/') || (entry.name == "..") || (entry.name.compare(0, 3, "../") == 0) ||
+			(entry.name.find("/../") != string::npos) || ((entry.name.size() >= 3) && (entry.name.compare(entry.name.size() - 3, 3, "/..") == 0)))
+		{
+			error("Refusing to extract " + entry.name + " outside the current directory");
+		}
+
+		makeParentDirectories(entry.name);
+		{
+			OutputFile output(entry.name);
+			reader.extract(entry, output);
+		}
+		chmod(entry.name.c_str(), (mode_t)entry.member.mode);
+	}
+}
+
+
+void listArchive(const string& archive_file)
+{
+	ArchiveReader reader(archive_file);
+	for (auto& entry : reader.entries())
+	{
+		printf("%12lld  %s\n", entry.member.length, entry.name.c_str());
+	}
+}
+
+
+// A log is a file that records are appended to over time. Each record is compressed as it arrives with
+// a StreamCompressor and written after a LogRecord header, so a reader tailing the file can decode it as
+// soon as it is complete while matches still reach back into earlier records. Every restartInterval
+// bytes of the log the compressor is replaced, which resets the dictionary, and the restart point is
+// added to an index of IndexEntry in <log>.idx so that a reader can start there without the records
+// before it. Restart records are also flagged in their header so a lost index entry can be rebuilt.
+struct LogRecord
+{
+	int storedLength;		// Length of the compressed record that follows
+	int rawLength;			// Length of the record
+	int restart;			// Non-zero if the record starts a new stream
+};
+
+
+const int LOG_DICTIONARY_LENGTH = 8192;
+
+
+// Return true if header is a plausible record header rather than torn or zero filled data
+bool isValidLogRecord(const LogRecord& header)
+{
+	return (header.rawLength >= 0) && (header.storedLength > 0) &&
+		   (header.storedLength <= StreamCompressor::bound(header.rawLength));
+}
+
+
+class LogAppender
+{
+public:
+	// Open the log at path for appending, creating it if necessary. A record left incomplete by a crash
+	// is removed along with any index entries beyond the end of the log, and appending resumes with a
+	// restart point.
+	LogAppender(const string& path, int restartInterval, const CompressOptions& options = CompressOptions())
+		: path(path), restartInterval(restartInterval), options(options)
+	{
+		validateOptions(LOG_DICTIONARY_LENGTH, options);
+		log = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+		index = open((path + ".idx").c_str(), O_RDWR | O_CREAT, 0644);
+		if ((log < 0) || (index < 0))
+		{
+			error("Unable to open log file " + path);
+		}
+		recover();
+	}
+
+	~LogAppender()
+	{
+		sync();
+		close(log);
+		close(index);
+	}
+
+	void append(const void* record, int length)
+	{
+		if (!compressor || (end - restartOffset >= restartInterval))
+		{
+			restart();
+		}
+
+		buffer.resize(sizeof(LogRecord) + (size_t)StreamCompressor::bound(length));
+		LogRecord header = {};
+		header.storedLength = compressor->compress(record, length, buffer.data() + sizeof(LogRecord),
+												   (int)(buffer.size() - sizeof(LogRecord)));
+		header.rawLength = length;
+		header.restart = (end == restartOffset);
+		memcpy(buffer.data(), &header, sizeof(header));
+		if (!writeAt(log, (const char*)buffer.data(), (long long)sizeof(header) + header.storedLength, end))
+		{
+			error("Unable to write log file " + path);
+		}
+		end += (long long)sizeof(header) + header.storedLength;
+		rawOffset += length;
+	}
+
+	// Make the records appended so far durable, then the index entries that point at them
+	void sync()
+	{
+		if ((fdatasync(log) != 0) || (fdatasync(index) != 0))
+		{
+			error("Unable to sync log file " + path);
+		}
+	}
+
+private:
+	void restart()
+	{
+		// The interval just completed is made durable before the next one begins
+		if (compressor)
+		{
+			sync();
+		}
+		compressor.reset(new StreamCompressor(LOG_DICTIONARY_LENGTH, options));
+		restartOffset = end;
+		addIndexEntry({ rawOffset, end });
+	}
+
+	void addIndexEntry(const IndexEntry& entry)
+	{
+		if (!writeAt(index, (const char*)&entry, sizeof(entry), entries * (long long)sizeof(entry)))
+		{
+			error("Unable to write log index " + path + ".idx");
+		}
+		entries++;
+	}
+
+	void recover()
+	{
+		// Keep the index entries that point into the log, then walk the records from the last of them to
+		// find the end of the last complete record, indexing any restart points that were missed
+		struct stat status = {};
+		fstat(log, &status);
+		long long length = (long long)status.st_size;
+		fstat(index, &status);
+		entries = (long long)status.st_size / (long long)sizeof(IndexEntry);
+
+		IndexEntry last = { 0, 0 };
+		while (entries > 0)
+		{
+			if ((pread(index, &last, sizeof(last), (off_t)((entries - 1) * sizeof(last))) == (ssize_t)sizeof(last)) &&
+				(last.frameOffset < length))
+			{
+				break;
+			}
+			last = { 0, 0 };
+			entries--;
+		}
+
+		end = last.frameOffset;
+		rawOffset = last.rawOffset;
+		bool indexed = (entries > 0);
+		LogRecord header = {};
+		while ((end + (long long)sizeof(header) <= length) &&
+			   (pread(log, &header, sizeof(header), (off_t)end) == (ssize_t)sizeof(header)) && isValidLogRecord(header) &&
+			   (end + (long long)sizeof(header) + header.storedLength <= length))
+		{
+			if (header.restart && !indexed)
+			{
+				addIndexEntry({ rawOffset, end });
+			}
+			indexed = false;
+			end += (long long)sizeof(header) + header.storedLength;
+			rawOffset += header.rawLength;
+		}
+
+		if ((ftruncate(log, (off_t)end) != 0) || (ftruncate(index, (off_t)(entries * sizeof(IndexEntry))) != 0))
+		{
+			error("Unable to recover log file " + path);
+		}
+	}
+
+	string path;
+	int restartInterval;
+	CompressOptions options;
+	int log = -1;
+	int index = -1;
+	long long entries = 0;			// Number of entries in the index
+	long long end = 0;				// Length of the log
+	long long rawOffset = 0;		// Length of the records in the log
+	long long restartOffset = 0;	// Offset of the last restart point
+	std::vector<unsigned char> buffer;
+	std::unique_ptr<StreamCompressor> compressor;
+};
+
+
+class LogReader
+{
+public:
+	// Read the log at path from its first record
+	explicit LogReader(const string& path) : path(path), log(path)
+	{
+	}
+
+	// Move to the last restart point in the index so that only the most recent records are decoded
+	void seekToLastRestart()
+	{
+		InputFile index(path + ".idx");
+		long long entries = index.size() / (long long)sizeof(IndexEntry);
+		IndexEntry entry = {};
+		if ((entries > 0) && !index.read((entries - 1) * (long long)sizeof(entry), &entry, sizeof(entry)))
+		{
+			error("Unable to read log index " + path + ".idx");
+		}
+		position = entry.frameOffset;
+		rawOffset = entry.rawOffset;
+		decompressor.reset();
+	}
+
+	// Decode the next record if it has been completely written, returning false if it hasn't
+	bool next(std::vector<unsigned char>& record)
+	{
+		LogRecord header = {};
+		if (!log.read(position, &header, sizeof(header)))
+		{
+			return false;
+		}
+		if (!isValidLogRecord(header))
+		{
+			error("Corrupt record in log file " + path);
+		}
+		// The payload is followed by a few zero bytes so that a corrupt record can't read beyond it
+		payload.resize((size_t)header.storedLength + 8);
+		memset(payload.data() + header.storedLength, 0, 8);
+		if (!log.read(position + (long long)sizeof(header), payload.data(), header.storedLength))
+		{
+			return false;
+		}
+
+		if (header.restart)
+		{
+			decompressor.reset(new StreamDecompressor());
+		}
+		if (!decompressor)
+		{
+			error("Log file " + path + " doesn't start with a restart point");
+		}
+		record.resize((size_t)header.rawLength);
+		if (decompressor->decompress(payload.data(), header.storedLength, record.data(), header.rawLength) != header.rawLength)
+		{
+			error("Corrupt record in log file " + path);
+		}
+		position += (long long)sizeof(header) + header.storedLength;
+		rawOffset += header.rawLength;
+		return true;
+	}
+
+	// Offset in the decoded log of the next record
+	long long offset() const
+	{
+		return rawOffset;
+	}
+
+private:
+	string path;
+	InputFile log;
+	long long position = 0;
+	long long rawOffset = 0;
+	std::vector<unsigned char> payload;
+	std::unique_ptr<StreamDecompressor> decompressor;
+};
+
+
+void appendLog(const string& log_file, const std::vector<string>& arguments)
+{
+	// Append each line of the standard input to the log as a record
+	CompressOptions options;
+	options.level = 4;
+	int restartInterval = 64 * 1024;
+	for (size_t i = 0; i < arguments.size(); i++)
+	{
+		if ((arguments[i] == "--level") && (i + 1 < arguments.size()))
+		{
+			options.level = atoi(arguments[++i].c_str());
+		}
+		else if ((arguments[i] == "--restart") && (i + 1 < arguments.size()))
+		{
+			restartInterval = atoi(arguments[++i].c_str()) * 1024;
+			if (restartInterval <= 0) error("Restart interval must be at least 1 KB");
+		}
+		else
+		{
+			error("Unknown option " + arguments[i]);
+		}
+	}
+
+	LogAppender appender(log_file, restartInterval, options);
+	string line;
+	while (std::getline(std::cin, line))
+	{
+		line += '\n';
+		appender.append(line.data(), (int)line.size());
+	}
+}
+
+
+void tailLog(const string& log_file, const std::vector<string>& arguments)
+{
+	// Write the records from the last restart point to the standard output, then wait for more if asked
+	bool follow = false;
+	for (auto& argument : arguments)
+	{
+		if (argument == "--follow")
+		{
+			follow = true;
+		}
+		else
+		{
+			error("Unknown option " + argument);
+		}
+	}
+
+	LogReader reader(log_file);
+	reader.seekToLastRestart();
+	std::vector<unsigned char> record;
+	while (true)
+	{
+		while (reader.next(record))
+		{
+			fwrite(record.data(), 1, record.size(), stdout);
+		}
+		fflush(stdout);
+		if (!follow)
+		{
+			break;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+}
+
+
+struct SearchMatch
+{
+	long long offset;		// Offset of the match in the decoded data
+	int pattern;			// Index of the pattern matched
+};
+
+
+// Searches decoded data for any of a set of patterns. Data is searched a piece at a time: find() reports
+// the matches lying wholly within a piece, which can be done for many pieces in parallel, while stitch()
+// is given every piece in order and reports the matches that span from earlier pieces into this one.
+class Search
+{
+public:
+	explicit Search(const std::vector<string>& patterns) : patterns(patterns)
+	{
+		for (auto& pattern : patterns)
+		{
+			if (pattern.empty()) error("Search patterns can not be empty");
+			if ((int)pattern.size() > longest) longest = (int)pattern.size();
+		}
+	}
+
+	// Append the matches lying wholly within data, which is at offset in the decoded data, in order
+	void find(const unsigned char* data, long long length, long long offset, std::vector<SearchMatch>& matches) const
+	{
+		size_t first = matches.size();
+		for (int index = 0; index < (int)patterns.size(); index++)
+		{
+			findPattern(data, length, offset, index, matches);
+		}
+		sortMatches(matches, first);
+	}
+
+	// Append the matches lying wholly within a run of zeros, which only patterns of zeros can match
+	void findZeros(long long length, long long offset, std::vector<SearchMatch>& matches) const
+	{
+		size_t first = matches.size();
+		for (int index = 0; index < (int)patterns.size(); index++)
+		{
+			const string& pattern = patterns[(size_t)index];
+			if (pattern.find_first_not_of('\0') != string::npos) continue;
+			for (long long position = 0; position + (long long)pattern.size() <= length; position++)
+			{
+				matches.push_back({ offset + position, index });
+			}
+		}
+		sortMatches(matches, first);
+	}
+
+	// Append the matches that start before data and end within it, which must follow all the data before
+	// it. Only the first and last longest - 1 bytes of data are read.
+	void stitch(const unsigned char* data, long long length, long long offset, std::vector<SearchMatch>& matches)
+	{
+		long long edge = (length < longest - 1) ? length : longest - 1;
+		stitchEdges(data, data + length - edge, length, offset, matches);
+	}
+
+	// As stitch() for a run of zeros, which doesn't need to be expanded
+	void stitchZeros(long long length, long long offset, std::vector<SearchMatch>& matches)
+	{
+		std::vector<unsigned char> zeros((size_t)longest);
+		stitchEdges(zeros.data(), zeros.data(), length, offset, matches);
+	}
+
+private:
+	void findPattern(const unsigned char* data, long long length, long long offset, int index,
+					 std::vector<SearchMatch>& matches) const
+	{
+		const string& pattern = patterns[(size_t)index];
+		auto p = (const unsigned char*)pattern.data();
+		long long m = (long long)pattern.size();
+		long long position = 0;
+#ifdef __SSE2__
+		// Compare 16 positions at a time against the first and last bytes of the pattern and only check the
+		// whole pattern where both agree
+		__m128i first = _mm_set1_epi8((char)p[0]);
+		__m128i last = _mm_set1_epi8((char)p[m - 1]);
+		for (; position + m - 1 + 16 <= length; position += 16)
+		{
+			__m128i a = _mm_cmpeq_epi8(first, _mm_loadu_si128((const __m128i*)(data + position)));
+			__m128i b = _mm_cmpeq_epi8(last, _mm_loadu_si128((const __m128i*)(data + position + m - 1)));
+			unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_and_si128(a, b));
+			while (mask)
+			{
+				int bit = __builtin_ctz(mask);
+				if (!memcmp(data + position + bit, p, (size_t)m))
+				{
+					matches.push_back({ offset + position + bit, index });
+				}
+				mask &= mask - 1;
+			}
+		}
+#endif
+		for (; position + m <= length; position++)
+		{
+			if ((data[position] == p[0]) && !memcmp(data + position, p, (size_t)m))
+			{
+				matches.push_back({ offset + position, index });
+			}
+		}
+	}
+
+	void stitchEdges(const unsigned char* head, const unsigned char* tail, long long length, long long offset,
+					 std::vector<SearchMatch>& matches)
+	{
+		// Search the seam made of the data carried from before and the start of this data, keeping the
+		// matches that cross into this data. Those that lie wholly within it are found by find().
+		long long edge = (length < longest - 1) ? length : longest - 1;
+		if (!carry.empty())
+		{
+			std::vector<unsigned char> seam(carry);
+			seam.insert(seam.end(), head, head + edge);
+			std::vector<SearchMatch> found;
+			find(seam.data(), (long long)seam.size(), offset - (long long)carry.size(), found);
+			for (auto& match : found)
+			{
+				if ((match.offset < offset) && (match.offset + (long long)patterns[(size_t)match.pattern].size() > offset))
+				{
+					matches.push_back(match);
+				}
+			}
+		}
+
+		// Carry the last longest - 1 bytes of everything passed so far on to the next seam
+		carry.insert(carry.end(), tail, tail + edge);
+		if ((int)carry.size() > longest - 1)
+		{
+			carry.erase(carry.begin(), carry.end() - (longest - 1));
+		}
+	}
+
+	static void sortMatches(std::vector<SearchMatch>& matches, size_t first)
+	{
+		std::sort(matches.begin() + (long)first, matches.end(), [](const SearchMatch& a, const SearchMatch& b)
+		{
+			return (a.offset < b.offset) || ((a.offset == b.offset) && (a.pattern < b.pattern));
+		});
+	}
+
+	std::vector<string> patterns;
+	int longest = 0;
+	std::vector<unsigned char> carry;
+};
+
+
+void searchStream(const DecodeJob& job, long long offset, Search& search,
+				  const std::function<void(const std::vector<SearchMatch>&)>& report)
+{
+	// Strings only copy from the last maxOffset bytes of output, so a legacy stream is decoded into a
+	// window, as in decodeNonTemporal(), and each chunk searched before the window moves on
+	auto stream = (const int*)job.payload.data();
+	int dictionaryLength = stream[1];
+	int maxOffset = dictionaryLength + 2;
+	int maxMatch = (65536 / dictionaryLength) + 2;
+	Decoder decoder(stream + 2, dictionaryLength);
+	const int chunkLength = 1 << 20;
+	std::vector<unsigned char> window((size_t)(maxOffset + chunkLength + maxMatch));
+	unsigned char* base = window.data() + maxOffset;
+	unsigned char* buffer = base;
+	long long remaining = job.rawLength;
+	std::vector<SearchMatch> matches;
+	while (remaining)
+	{
+		int length = decoder.next(buffer);
+		buffer += length;
+		remaining -= length;
+
+		if ((buffer - base >= chunkLength) || !remaining)
+		{
+			matches.clear();
+			search.stitch(base, buffer - base, offset, matches);
+			search.find(base, buffer - base, offset, matches);
+			report(matches);
+			offset += buffer - base;
+			memmove(window.data(), buffer - maxOffset, (size_t)maxOffset);
+			buffer = base;
+		}
+	}
+}
+
+
+void grepFile(const string& input_file, const std::vector<string>& arguments)
+{
+	// Search the decoded contents of input_file without writing them anywhere. Blocks are decoded and
+	// searched a batch at a time, one per thread, and their matches reported in order; only the blocks of
+	// the batch are held in memory. Legacy streams, which can be as long as the file, are decoded and
+	// searched through a window instead.
+	std::vector<string> patterns;
+	int threads = 1;
+	bool countOnly = false;
+	for (size_t i = 0; i < arguments.size(); i++)
+	{
+		if ((arguments[i] == "--threads") && (i + 1 < arguments.size()))
+		{
+			threads = atoi(arguments[++i].c_str());
+			if (threads < 1) error("The number of threads must be at least 1");
+		}
+		else if (arguments[i] == "--count")
+		{
+			countOnly = true;
+		}
+		else if ((arguments[i] == "-e") && (i + 1 < arguments.size()))
+		{
+			patterns.push_back(arguments[++i]);
+		}
+		else
+		{
+			patterns.push_back(arguments[i]);
+		}
+	}
+	if (patterns.empty())
+	{
+		error("No search pattern given");
+	}
+
+	InputFile input(input_file);
+	FrameScanner scanner(input, input_file);
+	Search search(patterns);
+	long long total = 0;
+	auto report = [&](const std::vector<SearchMatch>& matches)
+	{
+		total += (long long)matches.size();
+		if (!countOnly)
+		{
+			for (auto& match : matches)
+			{
+				printf("%lld:%s\n", match.offset, patterns[(size_t)match.pattern].c_str());
+			}
+		}
+	};
+
+	const long long windowLength = 1 << 20;
+	std::vector<DecodeJob> jobs((size_t)threads);
+	std::vector<std::vector<SearchMatch>> found((size_t)threads);
+	std::vector<SearchMatch> seam;
+	long long offset = 0;
+	while (true)
+	{
+		int count = 0;
+		while ((count < threads) && scanner.next(jobs[(size_t)count]))
+		{
+			count++;
+		}
+		if (count == 0)
+		{
+			break;
+		}
+
+		std::vector<long long> offsets((size_t)count);
+		for (int index = 0; index < count; index++)
+		{
+			offsets[(size_t)index] = offset;
+			offset += jobs[(size_t)index].rawLength;
+		}
+
+		parallelFor(count, threads, [&](int index)
+		{
+			DecodeJob& job = jobs[(size_t)index];
+			std::vector<SearchMatch>& matches = found[(size_t)index];
+			matches.clear();
+			if (job.type == BLOCK_ZERO)
+			{
+				search.findZeros(job.rawLength, offsets[(size_t)index], matches);
+			}
+			else if ((job.type == BLOCK_LZSS) && (job.rawLength > windowLength))
+			{
+				// Long legacy streams are left to be searched through a window when their turn comes
+				if (!isValidStream(job.payload.data(), job.storedLength, job.rawLength))
+				{
+					error("Corrupt block in " + input_file);
+				}
+			}
+			else
+			{
+				if (!decodeBlock(job))
+				{
+					error("Corrupt block in " + input_file);
+				}
+				search.find(job.output.data(), job.rawLength, offsets[(size_t)index], matches);
+			}
+		});
+
+		for (int index = 0; index < count; index++)
+		{
+			DecodeJob& job = jobs[(size_t)index];
+			long long jobOffset = offsets[(size_t)index];
+			if ((job.type == BLOCK_LZSS) && (job.rawLength > windowLength))
+			{
+				searchStream(job, jobOffset, search, report);
+				continue;
+			}
+
+			seam.clear();
+			if (job.type == BLOCK_ZERO)
+			{
+				search.stitchZeros(job.rawLength, jobOffset, seam);
+			}
+			else
+			{
+				search.stitch(job.output.data(), job.rawLength, jobOffset, seam);
+			}
+			report(seam);
+			report(found[(size_t)index]);
+		}
+	}
+
+	if (countOnly)
+	{
+		printf("%lld\n", total);
 	}
-	if (dictionaryLength < 4)
+}
+
+
+void analyseTrace(const string& trace_file)
+{
+	FILE* trace = fopen(trace_file.c_str(), "r");
+	if (!trace)
 	{
-		error ("Dictionary length can not be less than 4 bytes");
+		error("Unable to open trace file " + trace_file);
 	}
-	if (dictionaryLength > 16384)
+
+	long long literals = 0, matches = 0, matchBytes = 0, candidates = 0;
+	long long runs = 0, runLength = 0, longestRun = 0, wastedRuns = 0;
+	long long shortLiterals = 0, farLiterals = 0;
+	long long truncated = 0, truncatedBytes = 0, lazy = 0, lazyBytes = 0;
+	int maxOffset = 0, maxMatch = 0;
+	bool wasted = false;
+	long long lengths[65] = {};
+
+	char line[256];
+	while (fgets(line, sizeof(line), trace))
 	{
-		error ("Dictionary length can exceed 16384 bytes");
+		long long position = 0;
+		char kind = 0;
+		int a = 0, b = 0, c = 0, d = 0, e = 0;
+		if (line[0] == '#')
+		{
+			sscanf(line, "# length %*d maxOffset %d maxMatch %d", &maxOffset, &maxMatch);
+			continue;
+		}
+		int fields = sscanf(line, "%lld %c %d %d %d %d %d", &position, &kind, &a, &b, &c, &d, &e);
+		if (kind == 'L' && fields == 6)
+		{
+			// a = byte, b = best length, c = candidates, d = best length in the largest window
+			literals++;
+			runLength++;
+			candidates += c;
+			if (b == 2) shortLiterals++;
+			if (d > 2) { farLiterals++; wasted = true; }
+		}
+		else if (kind == 'M' && fields == 7)
+		{
+			// a = offset, b = length, c = candidates, d = unlimited length, e = length at next position
+			if (runLength)
+			{
+				runs++;
+				if (runLength > longestRun) longestRun = runLength;
+				if (wasted) wastedRuns++;
+				runLength = 0;
+				wasted = false;
+			}
+			matches++;
+			matchBytes += b;
+			candidates += c;
+			lengths[b < 64 ? b : 64]++;
+			if (b == maxMatch && d > b) { truncated++; truncatedBytes += d - b; }
+			if (e > b) { lazy++; lazyBytes += e - b; }
+		}
+		else
+		{
+			fclose(trace);
+			error("Malformed trace line: " + string(line));
+		}
 	}
+	fclose(trace);
 
-	// Ensure the destination buffer is big enough for at least the header information
-	if (outputLength < ((int)(sizeof(int) * 2)))
+	if (runLength)
 	{
-		error ("Destination buffer is too small");
+		runs++;
+		if (runLength > longestRun) longestRun = runLength;
+		if (wasted) wastedRuns++;
 	}
 
-	// Write header data to the destination buffer
-	auto header = (int*) output;
-	*header++ = inputLength;		// Write the uncompressed data length
-	*header++ = dictionaryLength;	// Write the dictionary length
+	// Each literal costs a flag bit and a byte, each match costs a flag bit and a 16-bit string
+	long long tokens = literals + matches;
+	long long bits = literals * 9 + matches * 17;
+	auto percent = [](long long part, long long whole) { return whole ? 100.0 * (double)part / (double)whole : 0.0; };
 
-	// Calculate the maximum offset and maximum match length for this dictionary length
-	int maxOffset = dictionaryLength + 2;
-	int maxMatch = (65536 / dictionaryLength) + 2;
-	int lengthShift = -1;
-	while (dictionaryLength) { lengthShift++; dictionaryLength >>= 1; }
+	printf("Tokens                 %12lld (maxOffset %d, maxMatch %d)\n", tokens, maxOffset, maxMatch);
+	printf("  literals             %12lld %6.2f%% of output bits\n", literals, percent(literals * 9, bits));
+	printf("  matches              %12lld %6.2f%% of output bits, %.2f bytes average\n",
+		   matches, percent(matches * 17, bits), matches ? (double)matchBytes / (double)matches : 0.0);
+	printf("  candidates           %12.1f per token\n", tokens ? (double)candidates / (double)tokens : 0.0);
+	printf("Match lengths\n");
+	for (int length = 3; length <= 64; length++)
+	{
+		if (lengths[length]) printf("  %2d%s                  %12lld %6.2f%%\n", length, length == 64 ? "+" : " ", lengths[length], percent(lengths[length], matches));
+	}
+	printf("Waste\n");
+	printf("  cut by maxMatch       %12lld matches, %lld bytes left for the next token\n", truncated, truncatedBytes);
+	printf("  missed longer match  %12lld matches, %lld bytes longer one position later\n", lazy, lazyBytes);
+	printf("  literal runs         %12lld runs, %.2f bytes average, %lld longest\n",
+		   runs, runs ? (double)literals / (double)runs : 0.0, longestRun);
+	printf("  2 byte matches       %12lld literals could only match 2 bytes\n", shortLiterals);
+	printf("  beyond the window    %12lld literals in %lld runs match 3+ bytes in a 16K window\n", farLiterals, wastedRuns);
+}
 
-	// The compressed data consists of 3 separate streams of data; bit flags, strings, and bytes.
-	// The bit flag indicates whether the next element of data is a string or a byte. The string is
-	// a 16-bit value containing an offset and a length from which a string should be copied. The byte
-	// value is simply a literal that should be stored. The data for each stream is written 32-bits at
-	// a time, therefore we accumulate 32 bit flags, 2 strings (16-bits each), or 4 bytes (8-bits each)
-	// before storing them. The data for each stream is written as soon as it is accumulated, hence the
-	// streams are interleaved in memory. On decompression, the compressed data can be read linearly
-	// with the data for each stream arriving exactly as its needed.
-
-	int* next = header;
-	int* outputEnd = (int*)((unsigned char*)output + outputLength);
-	int* nextBits = nullptr;
-	int* nextBytes = nullptr;
-	int* nextStrings = nullptr;
-	int  bits = 0;			// Bit accumulator
-	int  bitMask = 0;
-	int  bytes = 0;			// Byte accumulator
-	int  byteCount = 0;
-	int  strings = 0;		// String accumulator
-	int  stringCount = 0;
 
-	// Compress data
-	auto start = (unsigned char*)input;
-	auto current = (unsigned char*)input;
-	auto end = (unsigned char*)input + inputLength;
-	while (current < end)
+double probeCache(std::vector<unsigned char>& probe, std::atomic<bool>& stop)
+{
+	// Stand in for a co-located workload: random reads over a buffer that fits in the last level cache.
+	// Returns millions of reads per second; fewer reads means more of the buffer was evicted.
+	unsigned int x = 1;
+	unsigned int sum = 0;
+	long long reads = 0;
+	size_t mask = probe.size() - 1;
+	double start = now();
+	while (!stop.load(std::memory_order_relaxed))
 	{
-		// Find the start of the search window
-		unsigned char* search = current - maxOffset;
-		if (search < start) search = start;
-
-		// Find the longest match in the search window
-		int bestLength = 0;
-		int bestOffset = 0;
-		while ((search + bestLength) <= current)
+		for (int i = 0; i < 4096; i++)
 		{
-			unsigned char* p1 = search;
-			unsigned char* p2 = current;
-			int matchLength = 0;
+			x = x * 1664525 + 1013904223;
+			sum += probe[(x >> 4) & mask];
+		}
+		reads += 4096;
+	}
+	probe[0] = (unsigned char)sum;
+	return (double)reads / (now() - start) / 1e6;
+}
 
-			while ((*p1 == *p2) && (p1 < current) && (matchLength < maxMatch) && (p2 < end))
-			{
-				p1++;
-				p2++;
-				matchLength++;
-			}
 
-			if (matchLength >= bestLength)
+void benchmarkNonTemporal(const std::vector<unsigned char>& compressed, int sampleLength)
+{
+	// Decode the sample repeatedly into a large output so that it can't be held in cache, once with
+	// regular stores and once with non-temporal stores, while another thread measures how much of its
+	// own cached data survives
+	const long long outputLength = 512LL << 20;
+	int copies = (int)(outputLength / sampleLength);
+	std::vector<unsigned char> output((size_t)copies * sampleLength);
+
+	long cacheLength = sysconf(_SC_LEVEL3_CACHE_SIZE);
+	if (cacheLength <= 0) cacheLength = 16 << 20;
+	size_t probeLength = 1 << 20;
+	while ((long)(probeLength * 2) <= cacheLength / 2 && probeLength < (64u << 20)) probeLength *= 2;
+	std::vector<unsigned char> probe(probeLength, 1);
+
+	auto run = [&](int mode)
+	{
+		std::atomic<bool> stop(false);
+		double probeRate = 0;
+		std::thread prober([&]() { probeRate = probeCache(probe, stop); });
+		double decodeRate = 0;
+		if (mode >= 0)
+		{
+			double start = now();
+			for (int copy = 0; copy < copies; copy++)
 			{
-				bestLength = matchLength;
-				bestOffset = (int)(current - search);
+				decompress(compressed.data(), output.data() + (size_t)copy * sampleLength, sampleLength, mode == 1);
 			}
-
-			search++;
+			decodeRate = (double)output.size() / (now() - start) / (1024.0 * 1024.0);
+		}
+		else
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(500));
 		}
+		stop = true;
+		prober.join();
+		return std::make_pair(decodeRate, probeRate);
+	};
 
-		// If the bit accumulator is empty then reserve memory for the next 32-bits 
-		if (bitMask == 0)
+	printf("Non-temporal stores (%lld MB output, %zu KB cache probe)\n", (long long)(output.size() >> 20), probeLength >> 10);
+	auto idle = run(-1);
+	auto cached = run(0);
+	auto streamed = run(1);
+	printf("  probe alone                           %10.1f M reads/s\n", idle.second);
+	printf("  decompress cached      %10.1f MB/s %10.1f M reads/s\n", cached.first, cached.second);
+	printf("  decompress non-temporal%10.1f MB/s %10.1f M reads/s\n", streamed.first, streamed.second);
+}
+
+
+void benchmarkPrefetch(const InputFile& input)
+{
+	// The hash chain prefetching only pays off once the input no longer fits in cache, so this benchmark
+	// uses as much of the input as it can up to 256 MB
+	int length = (int)(input.size() < (256LL << 20) ? input.size() : (256LL << 20));
+	std::vector<unsigned char> data((size_t)length);
+	input.read(0, data.data(), length);
+	std::vector<unsigned char> compressed((size_t)length + length / 2 + 1024);
+
+	printf("Hash chain prefetch distance (%d MB input)\n", length >> 20);
+	for (int level : { 1, 4, 8 })
+	{
+		printf("  level %d", level);
+		for (int distance : { 0, 2, 4, 8, 16, 32 })
 		{
-			if (next == outputEnd) return false;		// fail if output buffer is too small
-			nextBits = next++;
-			bits = 0;
-			bitMask = 1;
+			CompressOptions options;
+			options.level = level;
+			options.prefetchDistance = distance;
+			double start = now();
+			compress(data.data(), length, compressed.data(), (int)compressed.size(), 8192, options);
+			printf("  %2d: %6.1f MB/s", distance, (double)length / (now() - start) / (1024.0 * 1024.0));
+			fflush(stdout);
 		}
+		printf("\n");
+	}
+}
 
-		// Did we find a matching string of more than 2 bytes?
-		if (bestLength > 2)
+
+void benchmarkPages(const InputFile& input)
+{
+	// Pages are taken from up to 64 MB of the input, compressed into a PageAllocator and decompressed,
+	// with one thread and then one per processor
+	int length = (int)(input.size() < (64LL << 20) ? input.size() : (64LL << 20));
+	std::vector<unsigned char> data((size_t)length);
+	input.read(0, data.data(), length);
+	std::vector<int> threadCounts = { 1 };
+	if (std::thread::hardware_concurrency() > 1)
+	{
+		threadCounts.push_back((int)std::thread::hardware_concurrency());
+	}
+
+	printf("Page compression (%d MB input)\n", length >> 20);
+	for (int pageLength : { 4096, PAGE_MAX_LENGTH })
+	{
+		int count = length / pageLength;
+		if (count == 0) continue;
+		for (int threads : threadCounts)
 		{
-			// Write a 1 bit to the bit stream to indicate next item is a string
-			// If we have accumulated 32-bits then flush the bit flags to memory
-			bits |= bitMask;
-			bitMask <<= 1;
-			if (!bitMask) *nextBits = bits;
+			PageAllocator allocator(pageLength);
+			std::vector<unsigned char*> slots((size_t)count);
+			std::atomic<int> types[4] = {};
+			double start = now();
+			parallelFor(count, threads, [&](int page)
+			{
+				unsigned char slot[PAGE_HEADER_LENGTH + PAGE_MAX_LENGTH];
+				int slotLength = compressPage(data.data() + (size_t)page * pageLength, pageLength, slot, (int)sizeof(slot));
+				slots[(size_t)page] = allocator.allocate(slotLength);
+				memcpy(slots[(size_t)page], slot, (size_t)slotLength);
+				types[slot[0] & 3]++;
+			});
+			double compressTime = now() - start;
 
-			// If the string accumulator is empty then reserve memory for the next 2 strings
-			if (stringCount == 0)
+			std::vector<unsigned char> output((size_t)count * pageLength);
+			start = now();
+			parallelFor(count, threads, [&](int page)
+			{
+				decompressPage(slots[(size_t)page], output.data() + (size_t)page * pageLength, pageLength);
+			});
+			double decompressTime = now() - start;
+			if (memcmp(output.data(), data.data(), output.size()))
 			{
-				if (next == outputEnd) return false;		// fail if output buffer is too small
-				nextStrings = next++;
-				strings = 0;
+				error("Page benchmark output differs from its input");
 			}
 
-			// Add the string offset and size to the offset accumulator
-			strings += (((bestLength - 3) << lengthShift) + (bestOffset - 3)) << (stringCount * 16);
-			stringCount++;
-
-			// If we have accumulated 2 strings then flush them to memory
-			if (stringCount == 2)
+			printf("  %2d KB pages, %2d thread%s: compress %8.0f pages/s, decompress %8.0f pages/s, ratio %.3f (%.3f in slabs)\n",
+				   pageLength / 1024, threads, threads == 1 ? " " : "s", count / compressTime, count / decompressTime,
+				   (double)output.size() / (double)allocator.used(), (double)output.size() / (double)allocator.reserved());
+			printf("               zero %d, filled %d, raw %d, lzss %d\n", types[PAGE_ZERO].load(), types[PAGE_FILLED].load(),
+				   types[PAGE_RAW].load(), types[PAGE_LZSS].load());
+			fflush(stdout);
+			for (auto slot : slots)
 			{
-				*nextStrings = strings;
-				stringCount = 0;
+				allocator.release(slot);
 			}
-
-			// Move along the current pointer by the size of the match
-			current += bestLength;
 		}
-		else
-		{
-			// Write a 0 bit to the bitstream to indicate next item is a byte literal
-			// If we have accumulated 32-bits then flush the bit flags to memory
-			bitMask <<= 1;					// By shifting the bitMask we are implicitly writing a 0 to the bit flags
-			if (!bitMask) *nextBits = bits;
+	}
+}
 
-			// If the byte accumulator is empty then reserve memory for the next 4 bytes
-			if (byteCount == 0)
-			{
-				if (next == outputEnd) return false;		// fail if output buffer is too small
-				nextBytes = next++;
-				bytes = 0;
-			}
 
-			// Add the current byte value to the byte accumulator
-			bytes += (*current++) << (byteCount * 8);
-			byteCount++;
+void benchmarkDictionary(const std::vector<unsigned char>& sample)
+{
+	// Messages of 512 bytes from the sample are compressed against its first 8 KB, with the dictionary
+	// prepared once, prepared again for every message, and without a dictionary
+	const int messageLength = 512;
+	const int dictionaryLength = 8192;
+	int count = ((int)sample.size() - dictionaryLength) / messageLength;
+	if (count <= 0) return;
 
-			// If we have accumulated 4 bytes then flush them to memory
-			if (byteCount == 4)
+	printf("Prepared dictionary (%d messages of %d bytes)\n", count, messageLength);
+	std::vector<unsigned char> compressed((size_t)StreamCompressor::bound(messageLength));
+	std::vector<unsigned char> decompressed((size_t)messageLength);
+	for (int level : { 0, 4 })
+	{
+		CompressOptions options;
+		options.level = level;
+		options.hashBits = 12;
+		PreparedDictionary dictionary(sample.data(), dictionaryLength, dictionaryLength, options);
+		DecoderDictionary decoderDictionary(dictionary);
+		printf("  level %d", level);
+		for (int mode = 0; mode < 3; mode++)
+		{
+			long long total = 0;
+			double start = now();
+			for (int message = 0; message < count; message++)
 			{
-				*nextBytes = bytes;
-				byteCount = 0;
+				const unsigned char* data = sample.data() + dictionaryLength + (size_t)message * messageLength;
+				CompressOptions messageOptions = options;
+				std::unique_ptr<PreparedDictionary> perMessage;
+				if (mode == 0)
+				{
+					messageOptions.dictionary = &dictionary;
+				}
+				else if (mode == 1)
+				{
+					perMessage.reset(new PreparedDictionary(sample.data(), dictionaryLength, dictionaryLength, options));
+					messageOptions.dictionary = perMessage.get();
+				}
+				total += compress(data, messageLength, compressed.data(), (int)compressed.size(), dictionaryLength, messageOptions);
 			}
+			double elapsed = now() - start;
+			printf("  %s: %8.0f msgs/s %6.1f bytes", mode == 0 ? "prepared" : (mode == 1 ? "per message" : "none"),
+				   count / elapsed, (double)total / count);
 		}
-	}
-
-	// Write any remaining data out to their respective streams
-	if (bitMask)     *nextBits = bits;
-	if (byteCount)   *nextBytes = bytes;
-	if (stringCount) *nextStrings = strings;
+		printf("\n");
 
-	// Calculate and return the size of the compressed data
-	int compressedLength = (int)((char*)next - (char*)output);
-	return compressedLength;
+		options.dictionary = &dictionary;
+		int length = compress(sample.data() + dictionaryLength, messageLength, compressed.data(), (int)compressed.size(),
+							  dictionaryLength, options);
+		decompress(compressed.data(), decompressed.data(), messageLength, decoderDictionary);
+		if ((length <= 0) || memcmp(decompressed.data(), sample.data() + dictionaryLength, (size_t)messageLength))
+		{
+			error("Dictionary benchmark output differs from its input");
+		}
+	}
 }
 
 
-int decompress(const void* input, void* output, int outputBufferLength)
+void benchmarkLanes(const std::vector<unsigned char>& sample)
 {
-	// Read the header information
-	auto current = (int*)input;
-	int  uncompressedLength = *current++;	// Read the uncompressed data length
-	int  dictionaryLength = *current++;		// Read the dictionary length
+	// Decode the sample as one stream and as 2 to 4 lanes, repeating each until enough output has been
+	// produced to time
+	int sampleLength = (int)sample.size();
+	int repeats = (int)((256LL << 20) / sampleLength) + 1;
+	std::vector<unsigned char> compressed((size_t)sampleLength * 2 + 1024);
+	std::vector<unsigned char> output((size_t)sampleLength);
 
-	// Make sure the output buffer is big enough
-	if (outputBufferLength < uncompressedLength)
+	printf("Lanes\n");
+	for (int lanes = 1; lanes <= MAX_LANES; lanes++)
 	{
-		error ("Destination buffer is too small");
+		int length = (lanes == 1)
+			? compress(sample.data(), sampleLength, compressed.data(), (int)compressed.size(), 8192)
+			: compressLanes(sample.data(), sampleLength, compressed.data(), (int)compressed.size(), lanes, 8192);
+		double start = now();
+		for (int repeat = 0; repeat < repeats; repeat++)
+		{
+			if (lanes == 1)
+			{
+				decompress(compressed.data(), output.data(), sampleLength);
+			}
+			else
+			{
+				decompressLanes(compressed.data(), output.data(), sampleLength);
+			}
+		}
+		double elapsed = now() - start;
+		if (memcmp(output.data(), sample.data(), (size_t)sampleLength))
+		{
+			error("Lanes benchmark output differs from its input");
+		}
+		printf("  %d lane%s %9d bytes %8.1f MB/s\n", lanes, lanes == 1 ? " " : "s", length,
+			   (double)sampleLength * repeats / elapsed / (1024.0 * 1024.0));
 	}
+}
 
-	// Calculate values needed to separate strings into their offset and length components
-	int offsetMask = dictionaryLength - 1;
-	int lengthShift = -1;
-	while (dictionaryLength) { lengthShift++; dictionaryLength >>= 1; }
-	int lengthMask = ((~offsetMask) & 0xffff) >> lengthShift;
 
-	// Initialize accumulators
-	int bits = 0;
-	int bytes = 0;
-	int strings = 0;
-	int bitMask = 0;
-	int byteCount = 0;
-	int stringCount = 0;
+void benchmarkBatch(const std::vector<unsigned char>& sample)
+{
+	// Compress the sample as separate messages of 64 to 448 bytes and decompress them all, one at a time
+	// and as a batch
+	const int dictionaryLength = 4096;
+	std::vector<std::vector<unsigned char>> messages;
+	std::vector<int> lengths;
+	for (size_t offset = 0; offset < sample.size(); )
+	{
+		int length = (int)std::min((size_t)(64 + (messages.size() * 67) % 384), sample.size() - offset);
+		std::vector<unsigned char> message((size_t)StreamCompressor::bound(length));
+		message.resize((size_t)compress(sample.data() + offset, length, message.data(), (int)message.size(), dictionaryLength));
+		messages.push_back(std::move(message));
+		lengths.push_back(length);
+		offset += (size_t)length;
+	}
 
-	// Decompress data
-	auto buffer = (unsigned char*)output;
-	int remaining = uncompressedLength;
-	while (remaining)
+	int count = (int)messages.size();
+	std::vector<const void*> inputs((size_t)count);
+	std::vector<void*> outputs((size_t)count);
+	std::vector<unsigned char> output(sample.size());
+	size_t offset = 0;
+	for (int i = 0; i < count; i++)
 	{
-		// If the bit accumulator is empty then fill it
-		if (!bitMask)
+		inputs[(size_t)i] = messages[(size_t)i].data();
+		outputs[(size_t)i] = output.data() + offset;
+		offset += (size_t)lengths[(size_t)i];
+	}
+
+	printf("Batch decoding (%d messages)\n", count);
+	for (int mode = 0; mode < 2; mode++)
+	{
+		if ((mode == 1) && !hasAvx2())
 		{
-			bits = *current++;
-			bitMask = 1;
+			printf("  AVX2 batch not supported\n");
+			break;
 		}
-
-		// Is next item a byte or a string?
-		if (bits & bitMask)
+		int repeats = 0;
+		double start = now();
+		double elapsed;
+		do
 		{
-			// If the string accumulator is empty then fill it
-			if (!stringCount)
+			if (mode == 0)
 			{
-				strings = *current++;
-				stringCount = 2;
+				for (int i = 0; i < count; i++)
+				{
+					decompress(inputs[(size_t)i], outputs[(size_t)i], lengths[(size_t)i]);
+				}
 			}
+			else
+			{
+				decompressBatch(inputs.data(), outputs.data(), lengths.data(), count);
+			}
+			repeats++;
+			elapsed = now() - start;
+		} while (elapsed < 0.5);
+		if (memcmp(output.data(), sample.data(), sample.size()))
+		{
+			error("Batch benchmark output differs from its input");
+		}
+		printf("  %-12s %10.0f msgs/s %8.1f MB/s\n", mode == 0 ? "decompress" : "AVX2 batch",
+			   (double)count * repeats / elapsed, (double)sample.size() * repeats / elapsed / (1024.0 * 1024.0));
+		memset(output.data(), 0, output.size());
+	}
+}
 
-			// It's a string, so copy it
-			unsigned char* p = buffer - (strings & offsetMask) - 3;
-			int length = ((strings >> lengthShift) & lengthMask) + 3;
-			memcpy(buffer, p, (size_t)length);
-			buffer += length;
-			remaining -= length;
 
-			strings >>= 16;
-			stringCount--;
-		}
-		else
+void benchmarkKernels(const std::vector<unsigned char>& sample)
+{
+	// Decode the sample with each decoder kernel the processor supports, compressed with a few dictionary
+	// lengths as those set the longest string and so how wide each group can be
+	int sampleLength = (int)sample.size();
+	std::vector<unsigned char> compressed((size_t)sampleLength * 2 + 1024);
+	std::vector<unsigned char> output((size_t)sampleLength);
+	printf("Decoder kernels\n");
+	for (int dictionaryLength : { 2048, 4096, 16384 })
+	{
+		compress(sample.data(), sampleLength, compressed.data(), (int)compressed.size(), dictionaryLength);
+		printf("  dictionary %5d", dictionaryLength);
+		for (int kernel = KERNEL_SCALAR; kernel <= bestKernel(); kernel++)
 		{
-			// If the byte accumulator is empty then fill it
-			if (!byteCount)
+			int repeats = 0;
+			double start = now();
+			double elapsed;
+			do
 			{
-				bytes = *current++;
-				byteCount = 4;
+				Decoder decoder((const int*)compressed.data() + 2, dictionaryLength);
+				decodeItems(decoder, output.data(), sampleLength, (DecodeKernel)kernel);
+				repeats++;
+				elapsed = now() - start;
+			} while (elapsed < 0.3);
+			if (memcmp(output.data(), sample.data(), (size_t)sampleLength))
+			{
+				error("Kernel benchmark output differs from its input");
 			}
-
-			// Write the next byte
-			*buffer++ = (unsigned char)(bytes & 0xff);
-			remaining--;
-
-			bytes >>= 8;
-			byteCount--;
+			printf("  %s %7.1f MB/s", kernel == KERNEL_SCALAR ? "scalar" : (kernel == KERNEL_AVX2 ? "AVX2" : "AVX-512"),
+				   (double)sampleLength * repeats / elapsed / (1024.0 * 1024.0));
+			memset(output.data(), 0, output.size());
 		}
-
-		// Shift bit mask for next data element
-		bitMask <<= 1;
+		printf("\n");
 	}
-
-	return uncompressedLength;
 }
 
 
-int getDecompressedLength(const void* input)
+void benchmark(const string& input_file)
 {
-	return *(int*)input;
+	// Benchmarks run on the first megabyte of the input so that even the slowest match finder finishes
+	// quickly; the decoder benchmarks repeat the sample to reach the output sizes they need
+	InputFile input(input_file);
+	int sampleLength = (int)(input.size() < (1 << 20) ? input.size() : (1 << 20));
+	if (sampleLength == 0)
+	{
+		error("Input file " + input_file + " is empty");
+	}
+	std::vector<unsigned char> sample((size_t)sampleLength);
+	input.read(0, sample.data(), sampleLength);
+
+	std::vector<unsigned char> compressed((size_t)sampleLength * 2 + 1024);
+	double start = now();
+	int compressedLength = compress(sample.data(), sampleLength, compressed.data(), (int)compressed.size(), 8192);
+	double elapsed = now() - start;
+	printf("Sample %d bytes, compressed %d bytes, ratio %.3f, compress %.1f MB/s\n", sampleLength, compressedLength,
+		   (double)sampleLength / (double)compressedLength, (double)sampleLength / elapsed / (1024.0 * 1024.0));
+	compressed.resize((size_t)compressedLength);
+
+	benchmarkNonTemporal(compressed, sampleLength);
+	benchmarkDictionary(sample);
+	benchmarkLanes(sample);
+	benchmarkBatch(sample);
+	benchmarkKernels(sample);
+	benchmarkPrefetch(input);
+	benchmarkPages(input);
 }
 
 
 int main(int argc, const char *argv[]) {
 
     // Parse command line
+    if (argc == 3 && string(argv[1]) == "-a") {
+        analyseTrace(argv[2]);
+        exit(EXIT_SUCCESS);
+    }
+    if (argc == 3 && string(argv[1]) == "-b") {
+        benchmark(argv[2]);
+        exit(EXIT_SUCCESS);
+    }
+    if (argc >= 4 && string(argv[1]) == "merge") {
+        mergeFiles(argv[2], std::vector<string>(argv + 3, argv + argc));
+        exit(EXIT_SUCCESS);
+    }
+    if (argc >= 3 && string(argv[1]) == "append") {
+        appendLog(argv[2], std::vector<string>(argv + 3, argv + argc));
+        exit(EXIT_SUCCESS);
+    }
+    if (argc >= 3 && string(argv[1]) == "grep") {
+        grepFile(argv[2], std::vector<string>(argv + 3, argv + argc));
+        exit(EXIT_SUCCESS);
+    }
+    if (argc >= 4 && string(argv[1]) == "archive") {
+        createArchive(argv[2], std::vector<string>(argv + 3, argv + argc));
+        exit(EXIT_SUCCESS);
+    }
+    if (argc >= 3 && string(argv[1]) == "extract") {
+        extractArchive(argv[2], std::vector<string>(argv + 3, argv + argc));
+        exit(EXIT_SUCCESS);
+    }
+    if (argc == 3 && string(argv[1]) == "list") {
+        listArchive(argv[2]);
+        exit(EXIT_SUCCESS);
+    }
+    if (argc >= 3 && string(argv[1]) == "tail") {
+        tailLog(argv[2], std::vector<string>(argv + 3, argv + argc));
+        exit(EXIT_SUCCESS);
+    }
     if (argc < 4) {
         help();
         exit(EXIT_SUCCESS);
@@ -294,72 +6074,93 @@ int main(int argc, const char *argv[]) {
     const string input_file(argv[2]);
     const string output_file(argv[3]);
 
-	if (mode == "-c")
+	Options options;
+	for (int i = 4; i < argc; i++)
 	{
-		// Read input file
-		cout << "Compressing " + input_file;
-		std::ifstream ifs(input_file, std::ifstream::binary);
-		if (ifs)
+		const string option(argv[i]);
+		if (option == "--stats")
 		{
-			// Read input file
-			ifs.seekg(0, std::ifstream::end);
-			int input_length = (int) ifs.tellg();
-			ifs.seekg(0, std::ifstream::beg);
-			char* input_buffer = new char[input_length];
-			ifs.read(input_buffer, input_length);
-			ifs.close();
-
-			// Compress file
-			int output_buffer_length = (input_length * 2) + 1024;		// expect that the compressed length will never be more than this
-			char* output_buffer = new char[output_buffer_length];
-			int output_length = compress(input_buffer, input_length, output_buffer, output_buffer_length, 8192);
-
-			// Write compressed file
-			if (output_length > 0)
+			options.stats = true;
+		}
+		else if (option == "--level" && i + 1 < argc)
+		{
+			options.level = atoi(argv[++i]);
+		}
+		else if (option == "--prefetch" && i + 1 < argc)
+		{
+			options.prefetchDistance = atoi(argv[++i]);
+		}
+		else if (option == "--threads" && i + 1 < argc)
+		{
+			options.threads = atoi(argv[++i]);
+			if (options.threads < 1) error("The number of threads must be at least 1");
+		}
+		else if (option == "--range" && i + 1 < argc)
+		{
+			if ((sscanf(argv[++i], "%lld:%lld", &options.rangeOffset, &options.rangeLength) != 2) ||
+				(options.rangeOffset < 0) || (options.rangeLength < 0))
 			{
-				std::ofstream ofs(output_file, std::ifstream::binary + std::ifstream::out);
-				ofs.write(output_buffer, output_length);
-				ofs.close();
+				error("Range must be given as offset:length");
 			}
 		}
-		else
+		else if (option == "--direct")
 		{
-			error("Unable to open input file " + input_file);
+			options.direct = true;
 		}
-	}
-	else if (mode == "-d")
-	{
-		// Read input file
-		cout << "Decompressing " + input_file;
-		std::ifstream ifs(input_file, std::ifstream::binary);
-		if (ifs)
+		else if (option == "--no-detect")
 		{
-			ifs.seekg(0, std::ifstream::end);
-			int input_length = (int) ifs.tellg();
-			ifs.seekg(0, std::ifstream::beg);
-			char* input_buffer = new char[input_length];
-			ifs.read(input_buffer, input_length);
-			ifs.close();
-
-			// Decompress file
-			int output_buffer_length = getDecompressedLength(input_buffer);
-			char* output_buffer = new char[output_buffer_length];
-			int output_length = decompress(input_buffer, output_buffer, output_buffer_length);
-
-			// Write decompressed file
-			std::ofstream ofs(output_file, std::ifstream::binary + std::ifstream::out);
-			ofs.write(output_buffer, output_length);
-			ofs.close();
+			options.detect = false;
+		}
+		else if (option == "--resume")
+		{
+			options.resume = true;
+		}
+		else if (option == "--legacy")
+		{
+			options.legacy = true;
+		}
+		else if (option == "--lanes" && i + 1 < argc)
+		{
+			options.lanes = atoi(argv[++i]);
+			if ((options.lanes < 1) || (options.lanes > MAX_LANES)) error("The number of lanes must be between 1 and 4");
+		}
+		else if (option == "--readahead" && i + 1 < argc)
+		{
+			options.readAhead = atoi(argv[++i]);
+			if (options.readAhead < 1) error("Read ahead depth must be at least 1");
+		}
+		else if (option == "--trace" && i + 1 < argc)
+		{
+			options.trace = argv[++i];
 		}
 		else
 		{
-			error("Unable to open input file " + input_file);
+			error("Unknown option " + option);
 		}
 	}
+
+	Stats stats;
+	stats.start = now();
+	stats.startCpu = cpuTime();
+	if (mode == "-c")
+	{
+		cout << "Compressing " + input_file << endl;
+		compressFile(input_file, output_file, options, stats);
+	}
+	else if (mode == "-d")
+	{
+		cout << "Decompressing " + input_file << endl;
+		decompressFile(input_file, output_file, options, stats);
+	}
 	else
 	{
 		error("Unknown option " + mode);
 	}
 
+	if (options.stats)
+	{
+		printStats(stats, mode == "-c", output_file);
+	}
+
     return EXIT_SUCCESS;
 }